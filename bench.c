@@ -0,0 +1,786 @@
+#include "rt/ustd.h"
+#include "rt/fileio.h"
+#include "sqz/sqz.h"
+
+// sqz_bench [options] [files...]
+//
+// Measures compression and decompression speed, ratio and working memory
+// of sqz_frame_compress() and sqz_frame_decompress() for every
+// combination of backends, levels, windows and thread counts.
+// Lists are comma separated values or ranges e.g. "-l 1,4-6,9".
+//
+//   -b backends    0: range 1: huffman 2: rans 3: split (default 0)
+//   -l levels      0..9 (default 1,6,9)
+//   -w window_bits 10..16 (default 16)
+//   -t threads     1..64 (default 1, only 1 without C11 <threads.h>)
+//   -k block_bits  frame block size (default 20)
+//   -r runs        repetitions, median is reported (default 5)
+//   -a             sqz_analyze() files and apply chosen filter
+//   -m             print sqz_memory_usage() of levels and windows and exit
+//   -csv file      write results as CSV
+//   -json file     write results as JSON
+//
+// Without files the test/ corpus is used (missing files are skipped).
+// Arguments "kind:size" (size in bytes with optional K, M, G suffix) are
+// generated instead of read: text (Markov chain of pseudo words), logs
+// (timestamped service log lines), records (32 bytes binary rows) and
+// random. Generators are deterministic: the same argument produces the
+// same bytes on every platform, so inputs of many GB need no storage.
+//
+// With t threads the source is cut into t block aligned slices that are
+// compressed into separate frames concurrently; each thread takes its
+// context from a sqz_pool made for the configuration, as a server would.
+// MB/s are 10^6 source bytes per second of wall clock time from start of
+// the first thread to the end of the last one.
+// Peak is the high water mark of bytes allocated by the harness for the
+// configuration: pool contexts, frame, output and filter buffers (the
+// source is not counted). All allocations go through bench_alloc() that
+// counts them, so peak is measured, not estimated. Context is the steady
+// state memory of one stream: sqz_memory_usage() of an encoder plus a
+// decoder, that is what every concurrent stream of a server keeps.
+
+#if __has_include(<threads.h>) // C11 threads are optional, see rt.h
+#define bench_threaded 1
+#else
+#define bench_threaded 0
+#endif
+
+enum {
+    bench_max_values  = 32,
+    bench_max_threads = bench_threaded ? 64 : 1,
+    bench_max_runs    = 101
+};
+
+typedef int (*bench_start_t)(void* arg);
+
+struct bench_list {
+    int32_t value[bench_max_values];
+    int32_t n;
+};
+
+struct bench_job { // one thread compresses and decompresses a slice
+    struct sqz_pool*         pool;
+    const struct sqz_params* params;
+    const uint8_t* data;     // slice of the source
+    uint8_t*       work;     // filtered copy of data or null
+    size_t         bytes;
+    uint8_t*       frame;
+    size_t         capacity;
+    size_t         written;
+    uint8_t*       out;      // decompressed slice
+    errno_t        error;
+};
+
+struct bench_result {
+    const char* file;
+    int32_t  backend;
+    int32_t  level;
+    int32_t  window_bits;
+    int32_t  threads;
+    int32_t  jobs;      // slices actually compressed in parallel
+    int32_t  filter;
+    uint64_t bytes;
+    uint64_t compressed;
+    uint64_t peak;       // bytes allocated at most
+    uint64_t context;    // encoder + decoder bytes per stream
+    double   compress;   // MB/s median
+    double   decompress; // MB/s median
+};
+
+static struct bench_list bench_backends = { {sqz_range}, 1 };
+static struct bench_list bench_levels   = { {1, 6, 9}, 3 };
+static struct bench_list bench_windows  = { {sqz_chain_win_bits}, 1 };
+static struct bench_list bench_threads  = { {1}, 1 };
+static int32_t bench_block_bits = 20;
+static int32_t bench_runs = 5;
+static bool    bench_analyze;
+
+static bool    bench_memory;
+
+// Allocator hook: size is kept in front of every block so that bytes in
+// use and their high water mark are exact. Only the main thread
+// allocates, workers use memory prepared for them.
+
+static size_t bench_allocated;
+static size_t bench_peak;
+
+static void* bench_alloc(size_t bytes) {
+    if (bytes > SIZE_MAX - 16) { return null; }
+    uint8_t* p = (uint8_t*)malloc(bytes + 16); // keeps 16 bytes alignment
+    if (p == null) { return null; }
+    memcpy(p, &bytes, sizeof(bytes));
+    bench_allocated += bytes;
+    if (bench_peak < bench_allocated) { bench_peak = bench_allocated; }
+    return p + 16;
+}
+
+static void bench_free(void* a) {
+    if (a != null) {
+        uint8_t* p = (uint8_t*)a - 16;
+        size_t bytes = 0;
+        memcpy(&bytes, p, sizeof(bytes));
+        assert(bench_allocated >= bytes);
+        bench_allocated -= bytes;
+        free(p);
+    }
+}
+
+static errno_t bench_parse(struct bench_list* list, const char* s,
+                           int32_t lo, int32_t hi) {
+    list->n = 0;
+    while (*s != 0) {
+        char* e = null;
+        long from = strtol(s, &e, 10);
+        long to = from;
+        if (e == s) { return EINVAL; }
+        if (*e == '-') {
+            s = e + 1;
+            to = strtol(s, &e, 10);
+            if (e == s) { return EINVAL; }
+        }
+        if (from < lo || to > hi || from > to) { return ERANGE; }
+        for (long v = from; v <= to; v++) {
+            if (list->n == bench_max_values) { return E2BIG; }
+            list->value[list->n++] = (int32_t)v;
+        }
+        if (*e == ',') { e++; } else if (*e != 0) { return EINVAL; }
+        s = e;
+    }
+    return list->n > 0 ? 0 : EINVAL;
+}
+
+static int bench_compare(const void* a, const void* b) {
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double bench_median(double* seconds, int32_t n) {
+    qsort(seconds, (size_t)n, sizeof(seconds[0]), bench_compare);
+    return n % 2 == 1 ? seconds[n / 2] :
+        (seconds[n / 2 - 1] + seconds[n / 2]) / 2;
+}
+
+static int bench_compress(void* arg) {
+    struct bench_job* j = (struct bench_job*)arg;
+    struct sqz* s = sqz_pool_acquire(j->pool, sqz_pool_encoder);
+    if (s == null) {
+        j->error = ENOMEM;
+    } else {
+        const uint8_t* data = j->data;
+        if (j->work != null) {
+            memcpy(j->work, j->data, j->bytes); // caller owns the source
+            sqz_filter_encode(j->params, j->work, j->bytes);
+            data = j->work;
+        }
+        j->written = sqz_frame_compress(s, j->params, data, j->bytes,
+                                        j->frame, j->capacity);
+        j->error = s->rc.error;
+        sqz_pool_release(j->pool, s);
+    }
+    sqz_pool_flush(j->pool);
+    return 0;
+}
+
+static int bench_decompress(void* arg) {
+    struct bench_job* j = (struct bench_job*)arg;
+    struct sqz* s = sqz_pool_acquire(j->pool, sqz_pool_decoder);
+    if (s == null) {
+        j->error = ENOMEM;
+    } else {
+        const size_t n = sqz_frame_decompress(s, j->frame, j->written,
+                                              j->out, j->bytes);
+        j->error = s->rc.error;
+        if (j->error == 0 && n != j->bytes) { j->error = EILSEQ; }
+        sqz_pool_release(j->pool, s);
+    }
+    sqz_pool_flush(j->pool);
+    return 0;
+}
+
+// runs job[0] on the calling thread and the rest on new threads,
+// returns seconds of wall clock time of all of them:
+
+static double bench_run(bench_start_t f, struct bench_job job[], int32_t n,
+                        errno_t* error) {
+    const uint64_t start = sqz_trace_time();
+    #if bench_threaded
+        thrd_t thread[bench_max_threads];
+        int32_t started = 1;
+        while (started < n && *error == 0) {
+            if (thrd_create(&thread[started], f, &job[started]) !=
+                thrd_success) {
+                *error = EAGAIN;
+            } else {
+                started++;
+            }
+        }
+        f(&job[0]);
+        for (int32_t i = 1; i < started; i++) { thrd_join(thread[i], null); }
+    #else
+        assert(n == 1); // -t is limited to bench_max_threads
+        f(&job[0]);
+    #endif
+    const uint64_t end = sqz_trace_time();
+    for (int32_t i = 0; i < n && *error == 0; i++) { *error = job[i].error; }
+    return (double)(end - start) / 1e9;
+}
+
+static errno_t bench(const uint8_t* data, size_t bytes,
+                     const struct sqz_params* p, int32_t threads,
+                     struct bench_result* r) {
+    const size_t block = (size_t)1 << p->block_bits;
+    // slices of the source are multiple of block bytes:
+    const size_t blocks = bytes == 0 ? 1 : (bytes + block - 1) / block;
+    const size_t per = (blocks + (size_t)threads - 1) / (size_t)threads;
+    const size_t slice = per * block;
+    const int32_t jobs = bytes == 0 ? 1 : (int32_t)((bytes + slice - 1) / slice);
+    struct bench_job job[bench_max_threads] = {0};
+    struct sqz_pool pool = {0};
+    const size_t pool_bytes = sqz_pool_sizeof(p, (uint32_t)jobs);
+    const size_t allocated = bench_allocated;
+    bench_peak = allocated;
+    void* memory = pool_bytes == 0 ? null : bench_alloc(pool_bytes);
+    uint8_t* out = (uint8_t*)bench_alloc(bytes + 1);
+    uint8_t* work = p->filter == sqz_filter_none ?
+                    null : (uint8_t*)bench_alloc(bytes + 1);
+    errno_t e = pool_bytes == 0 ? EINVAL :
+        (memory == null || out == null ||
+        (work == null && p->filter != sqz_filter_none) ? ENOMEM : 0);
+    if (e == 0) {
+        e = sqz_pool_init(&pool, memory, pool_bytes, p, (uint32_t)jobs);
+    }
+    struct sqz_memory_usage encoder;
+    struct sqz_memory_usage decoder;
+    if (e == 0) { e = sqz_memory_usage(p, sqz_pool_encoder, 0, &encoder); }
+    if (e == 0) { e = sqz_memory_usage(p, sqz_pool_decoder, 0, &decoder); }
+    if (e == 0) { r->context = encoder.total + decoder.total; }
+    for (int32_t i = 0; i < jobs && e == 0; i++) {
+        struct bench_job* j = &job[i];
+        const size_t offset = (size_t)i * slice;
+        j->pool     = &pool;
+        j->params   = p;
+        j->data     = data + offset;
+        j->work     = work == null ? null : work + offset;
+        j->bytes    = bytes - offset < slice ? bytes - offset : slice;
+        j->out      = out + offset;
+        j->capacity = sqz_frame_bound(p, j->bytes);
+        j->frame    = (uint8_t*)bench_alloc(j->capacity);
+        if (j->frame == null) { e = ENOMEM; }
+    }
+    double cs[bench_max_runs];
+    double ds[bench_max_runs];
+    for (int32_t run = 0; run < bench_runs && e == 0; run++) {
+        cs[run] = bench_run(bench_compress, job, jobs, &e);
+        if (e == 0) { ds[run] = bench_run(bench_decompress, job, jobs, &e); }
+        if (e == 0 && run == 0 && memcmp(data, out, bytes) != 0) {
+            e = ENODATA;
+        }
+    }
+    if (e == 0) {
+        r->jobs = jobs;
+        r->compressed = 0;
+        for (int32_t i = 0; i < jobs; i++) { r->compressed += job[i].written; }
+        const double mb = (double)bytes / 1e6;
+        const double c = bench_median(cs, bench_runs);
+        const double d = bench_median(ds, bench_runs);
+        r->compress   = c > 0 ? mb / c : 0;
+        r->decompress = d > 0 ? mb / d : 0;
+    }
+    r->peak = bench_peak - allocated;
+    for (int32_t i = 0; i < jobs; i++) { bench_free(job[i].frame); }
+    bench_free(work);
+    bench_free(out);
+    bench_free(memory);
+    assert(bench_allocated == allocated); // nothing leaked
+    return e;
+}
+
+static const char* bench_backend_name(int32_t backend) {
+    static const char* name[] = { "range", "huffman", "rans", "split" };
+    return 0 <= backend && backend < countof(name) ? name[backend] : "?";
+}
+
+static const char* bench_basename(const char* fn) {
+    const char* b = strrchr(fn, '\\');
+    if (b == null) { b = strrchr(fn, '/'); }
+    return b != null ? b + 1 : fn;
+}
+
+static void bench_print(const struct bench_result* r) {
+    printf("%-14s %-7s %5d %6d %7d %8lld %8lld %6.2f%% %9.2f %9.2f %9lld"
+           " %8lld\n",
+           bench_basename(r->file), bench_backend_name(r->backend),
+           r->level, r->window_bits, r->threads,
+           r->bytes, r->compressed,
+           r->bytes > 0 ? r->compressed * 100.0 / r->bytes : 0,
+           r->compress, r->decompress, r->peak, r->context);
+}
+
+static void bench_csv(FILE* f, const struct bench_result* r) {
+    fprintf(f, "%s,%s,%d,%d,%d,%d,%d,%lld,%lld,%.4f,%.3f,%.3f,%lld,%lld\n",
+            bench_basename(r->file), bench_backend_name(r->backend),
+            r->level, r->window_bits, r->threads, r->jobs, r->filter,
+            r->bytes, r->compressed,
+            r->bytes > 0 ? (double)r->compressed / r->bytes : 0,
+            r->compress, r->decompress, r->peak, r->context);
+}
+
+static void bench_json(FILE* f, const struct bench_result* r, bool first) {
+    fprintf(f, "%s\n  {\"file\":\"%s\",\"backend\":\"%s\",\"level\":%d,"
+            "\"window_bits\":%d,\"threads\":%d,\"jobs\":%d,\"filter\":%d,"
+            "\"bytes\":%lld,\"compressed\":%lld,\"ratio\":%.4f,"
+            "\"compress_mbs\":%.3f,\"decompress_mbs\":%.3f,"
+            "\"peak\":%lld,\"context\":%lld}",
+            first ? "" : ",",
+            bench_basename(r->file), bench_backend_name(r->backend),
+            r->level, r->window_bits, r->threads, r->jobs, r->filter,
+            r->bytes, r->compressed,
+            r->bytes > 0 ? (double)r->compressed / r->bytes : 0,
+            r->compress, r->decompress, r->peak, r->context);
+}
+
+// Deterministic generators of synthetic input:
+
+static uint64_t bench_random(uint64_t* state) { // splitmix64
+    uint64_t z = (*state += 0x9E3779B97F4A7C15uLL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9uLL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBuLL;
+    return z ^ (z >> 31);
+}
+
+static uint32_t bench_below(uint64_t* state, uint32_t n) { // [0..n)
+    return (uint32_t)(((bench_random(state) >> 32) * n) >> 32);
+}
+
+struct bench_zipf { // P(k) ~ 1 / (k + 1), k: [0..n)
+    uint32_t cdf[4096]; // scaled to 2^32
+    uint32_t n;
+};
+
+static void bench_zipf_init(struct bench_zipf* z, uint32_t n) {
+    assert(0 < n && n <= countof(z->cdf));
+    double total = 0;
+    for (uint32_t k = 0; k < n; k++) { total += 1.0 / (k + 1); }
+    double sum = 0;
+    for (uint32_t k = 0; k < n; k++) {
+        sum += 1.0 / (k + 1);
+        const double c = sum / total * 4294967296.0;
+        z->cdf[k] = c < 4294967295.0 ? (uint32_t)c : UINT32_MAX;
+    }
+    z->cdf[n - 1] = UINT32_MAX;
+    z->n = n;
+}
+
+static uint32_t bench_zipf(const struct bench_zipf* z, uint64_t* state) {
+    const uint32_t u = (uint32_t)(bench_random(state) >> 32);
+    uint32_t lo = 0;
+    uint32_t hi = z->n - 1;
+    while (lo < hi) {
+        const uint32_t m = (lo + hi) / 2;
+        if (z->cdf[m] < u) { lo = m + 1; } else { hi = m; }
+    }
+    return lo;
+}
+
+struct bench_out { // clips everything written at bytes
+    uint8_t* data;
+    size_t   bytes;
+    size_t   written;
+};
+
+static void bench_put(struct bench_out* o, const void* p, size_t n) {
+    if (n > o->bytes - o->written) { n = o->bytes - o->written; }
+    memcpy(o->data + o->written, p, n);
+    o->written += n;
+}
+
+static void bench_puts(struct bench_out* o, const char* s) {
+    bench_put(o, s, strlen(s));
+}
+
+enum { bench_words = 4096 };
+
+static void bench_text(struct bench_out* o, uint64_t seed) {
+    // order 1 Markov chain: successors of every word are Zipf ranked
+    // in its own order, so that some word pairs are frequent
+    static const char* syllable[] = {
+        "a", "an", "ar", "be", "ca", "de", "di", "el", "en", "er", "es",
+        "fo", "ga", "he", "in", "is", "it", "ka", "la", "le", "li", "lo",
+        "ma", "me", "mo", "na", "ne", "no", "on", "or", "pa", "pe", "ra",
+        "re", "ri", "ro", "sa", "se", "si", "so", "st", "ta", "te", "th",
+        "ti", "to", "tr", "un", "ve", "wa"
+    };
+    static char word[bench_words][16];
+    static struct bench_zipf zipf;
+    uint64_t state = seed;
+    bench_zipf_init(&zipf, bench_words);
+    for (uint32_t w = 0; w < bench_words; w++) {
+        // frequent words (low ranks) are short:
+        const uint32_t n = 1 + (w >= 64) + (w >= 512) + bench_below(&state, 2);
+        word[w][0] = 0;
+        for (uint32_t k = 0; k < n; k++) {
+            strcat(word[w], syllable[bench_below(&state, countof(syllable))]);
+        }
+    }
+    uint32_t w = 0;
+    size_t column = 0;
+    bool capital = true;
+    while (o->written < o->bytes) {
+        const uint32_t rank = bench_zipf(&zipf, &state);
+        w = (w * 2654435761u + rank * 40503u + rank) % bench_words;
+        char text[24];
+        snprintf(text, sizeof(text), "%s", word[w]);
+        if (capital) { text[0] = (char)(text[0] - 'a' + 'A'); }
+        capital = false;
+        const size_t n = strlen(text);
+        if (column + n >= 72) { bench_puts(o, "\n"); column = 0; }
+        if (column > 0) { bench_puts(o, " "); column++; }
+        bench_puts(o, text);
+        column += n;
+        const uint32_t r = bench_below(&state, 64);
+        if (r < 4) {
+            bench_puts(o, ".");
+            capital = true;
+            if (r == 0) { bench_puts(o, "\n\n"); column = 0; }
+        } else if (r < 8) {
+            bench_puts(o, ",");
+        }
+    }
+}
+
+static void bench_time(char* s, size_t n, uint64_t ms) { // ISO 8601 UTC
+    // days since 1970-01-01 to civil date (Howard Hinnant's algorithm)
+    const int64_t z = (int64_t)(ms / 86400000) + 719468;
+    const int64_t era = z / 146097;
+    const int64_t doe = z - era * 146097;
+    const int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const int64_t mp = (5 * doy + 2) / 153;
+    const int64_t d = doy - (153 * mp + 2) / 5 + 1;
+    const int64_t m = mp < 10 ? mp + 3 : mp - 9;
+    const int64_t y = yoe + era * 400 + (m <= 2);
+    const uint64_t t = ms % 86400000;
+    snprintf(s, n, "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+             (int)y, (int)m, (int)d, (int)(t / 3600000),
+             (int)(t / 60000 % 60), (int)(t / 1000 % 60), (int)(t % 1000));
+}
+
+static void bench_logs(struct bench_out* o, uint64_t seed) {
+    static const char* level[] = { "INFO", "DEBUG", "WARN", "ERROR" };
+    static const char* service[] = {
+        "gateway", "auth", "billing", "search", "storage", "mailer",
+        "scheduler", "metrics"
+    };
+    static const char* message[] = {
+        "request completed", "cache miss", "connection opened",
+        "connection closed", "retrying request", "user logged in",
+        "token refreshed", "query executed", "job scheduled",
+        "job finished", "slow response from upstream", "rate limit exceeded",
+        "invalid argument", "disk usage above threshold",
+        "certificate expires soon", "failed to reach replica"
+    };
+    static struct bench_zipf zipf;
+    bench_zipf_init(&zipf, countof(message));
+    uint64_t state = seed;
+    uint64_t ms = 1735689600000uLL; // 2025-01-01T00:00:00Z
+    while (o->written < o->bytes) {
+        ms += bench_below(&state, 50);
+        const uint32_t k = bench_zipf(&zipf, &state);
+        const uint32_t s = bench_below(&state, countof(service));
+        char t[32];
+        bench_time(t, sizeof(t), ms);
+        char line[256];
+        snprintf(line, sizeof(line),
+            "%s %-5s host-%02u %s[%u]: %s id=%08x latency=%ums status=%u\n",
+            t, level[k < 10 ? k % 2 : 2 + k % 2], bench_below(&state, 16),
+            service[s], 1000 + s * 17, message[k],
+            (uint32_t)(bench_random(&state) >> 32),
+            1 + bench_below(&state, 1 + (k + 1) * 30),
+            k < 12 ? 200 : 400 + k);
+        bench_puts(o, line);
+    }
+}
+
+static void bench_store(uint8_t* p, uint64_t v, size_t n) { // little endian
+    for (size_t i = 0; i < n; i++) { p[i] = (uint8_t)(v >> (i * 8)); }
+}
+
+static void bench_records(struct bench_out* o, uint64_t seed) {
+    // uint64 id, uint64 ns time, uint32 account, uint16 type,
+    // uint16 flags, int64 amount in cents
+    static struct bench_zipf zipf;
+    bench_zipf_init(&zipf, countof(zipf.cdf));
+    uint64_t state = seed;
+    uint64_t id = 1000000;
+    uint64_t ns = 1735689600000000000uLL;
+    int64_t amount = 10000;
+    while (o->written < o->bytes) {
+        uint8_t r[32];
+        ns += 1000 * bench_below(&state, 100000);
+        amount += (int64_t)bench_below(&state, 2001) - 1000;
+        if (amount < 0) { amount = -amount; }
+        const uint32_t account = bench_zipf(&zipf, &state) * 2654435761u;
+        const uint32_t type = bench_zipf(&zipf, &state) % 8;
+        const uint32_t flags = bench_below(&state, 64) == 0 ? 0x8000 : 0;
+        bench_store(r +  0, id++, 8);
+        bench_store(r +  8, ns, 8);
+        bench_store(r + 16, account, 4);
+        bench_store(r + 20, type, 2);
+        bench_store(r + 22, flags, 2);
+        bench_store(r + 24, (uint64_t)amount, 8);
+        bench_put(o, r, sizeof(r));
+    }
+}
+
+static void bench_noise(struct bench_out* o, uint64_t seed) {
+    uint64_t state = seed;
+    while (o->written < o->bytes) {
+        const uint64_t v = bench_random(&state);
+        bench_put(o, &v, sizeof(v)); // byte order is irrelevant for noise
+    }
+}
+
+static const struct {
+    const char* kind;
+    void (*generate)(struct bench_out* o, uint64_t seed);
+} bench_generator[] = {
+    { "text",    bench_text    },
+    { "logs",    bench_logs    },
+    { "records", bench_records },
+    { "random",  bench_noise   },
+};
+
+// returns index of generator for "kind:size" or -1 and size in bytes:
+
+static int32_t bench_generator_of(const char* s, uint64_t* bytes) {
+    const char* colon = strchr(s, ':');
+    if (colon == null) { return -1; }
+    char* e = null;
+    uint64_t n = strtoull(colon + 1, &e, 10);
+    if (e == colon + 1) { return -1; }
+    const char unit = *e;
+    if (unit == 'K' || unit == 'k') { n <<= 10; e++; }
+    else if (unit == 'M' || unit == 'm') { n <<= 20; e++; }
+    else if (unit == 'G' || unit == 'g') { n <<= 30; e++; }
+    if (*e != 0) { return -1; }
+    for (int32_t i = 0; i < countof(bench_generator); i++) {
+        const size_t k = strlen(bench_generator[i].kind);
+        if ((size_t)(colon - s) == k &&
+            memcmp(s, bench_generator[i].kind, k) == 0) {
+            *bytes = n;
+            return i;
+        }
+    }
+    return -1;
+}
+
+static errno_t bench_generate(int32_t g, uint64_t bytes, const uint8_t* *data) {
+    if (bytes > SIZE_MAX / 4) { return E2BIG; } // frames and output too
+    struct bench_out o = { (uint8_t*)bench_alloc((size_t)bytes + 1),
+                           (size_t)bytes, 0 };
+    if (o.data == null) { return ENOMEM; }
+    bench_generator[g].generate(&o, 0x5EED0000uLL + (uint64_t)g);
+    *data = o.data;
+    return 0;
+}
+
+static errno_t bench_file(const char* fn, FILE* csv, FILE* json,
+                          bool* first) {
+    const uint8_t* data = null;
+    size_t bytes = 0;
+    uint64_t size = 0;
+    const int32_t g = bench_generator_of(fn, &size);
+    errno_t e = 0;
+    if (g >= 0) {
+        e = bench_generate(g, size, &data);
+        bytes = (size_t)size;
+        if (e != 0) { printf("%s: %s\n", fn, strerror(e)); }
+    } else {
+        e = file_read_fully(fn, &data, &bytes);
+    }
+    struct sqz_params analyzed;
+    sqz_params_init(&analyzed);
+    if (e == 0 && bench_analyze) { sqz_analyze(data, bytes, &analyzed); }
+    for (int32_t b = 0; b < bench_backends.n && e == 0; b++) {
+        for (int32_t l = 0; l < bench_levels.n && e == 0; l++) {
+            for (int32_t w = 0; w < bench_windows.n && e == 0; w++) {
+                for (int32_t t = 0; t < bench_threads.n && e == 0; t++) {
+                    struct sqz_params p = analyzed; // filter, stride, row
+                    p.backend     = bench_backends.value[b];
+                    p.level       = bench_levels.value[l];
+                    p.window_bits = bench_windows.value[w];
+                    p.block_bits  = bench_block_bits;
+                    struct bench_result r = {0};
+                    r.file        = fn;
+                    r.backend     = p.backend;
+                    r.level       = p.level;
+                    r.window_bits = p.window_bits;
+                    r.threads     = bench_threads.value[t];
+                    r.filter      = p.filter;
+                    r.bytes       = bytes;
+                    e = bench(data, bytes, &p, r.threads, &r);
+                    if (e != 0) {
+                        printf("%s: %s\n", fn, strerror(e));
+                    } else {
+                        bench_print(&r);
+                        if (csv != null) { bench_csv(csv, &r); }
+                        if (json != null) { bench_json(json, &r, *first); }
+                        *first = false;
+                    }
+                }
+            }
+        }
+    }
+    if (g >= 0) { bench_free((void*)data); } else { free((void*)data); }
+    return e;
+}
+
+static const char* bench_corpus[] = {
+    "test/bible.txt",
+    "test/hhgttg.txt",
+    "test/confucius.txt",
+    "test/laozi.txt",
+    "test/sqlite3.c",
+    "test/arm64.elf",
+    "test/x64.elf",
+    "test/mandrill.bmp",
+    "test/mandrill.png",
+};
+
+// bytes of encoder and decoder contexts by part for every level and
+// window (backends do not change memory):
+
+static errno_t bench_memory_usage(void) {
+    printf("%5s %6s %-7s %8s %8s %8s %8s %9s\n", "level", "window",
+           "kind", "head", "models", "chain", "block", "total");
+    for (int32_t l = 0; l < bench_levels.n; l++) {
+        for (int32_t w = 0; w < bench_windows.n; w++) {
+            struct sqz_params p;
+            sqz_params_init(&p);
+            p.level       = bench_levels.value[l];
+            p.window_bits = bench_windows.value[w];
+            p.block_bits  = bench_block_bits;
+            for (int32_t kind = sqz_pool_encoder; kind <= sqz_pool_decoder;
+                 kind++) {
+                struct sqz_memory_usage u;
+                const errno_t e = sqz_memory_usage(&p, kind, 0, &u);
+                if (e != 0) { return e; }
+                printf("%5d %6d %-7s %8lld %8lld %8lld %8lld %9lld\n",
+                       p.level, p.window_bits,
+                       kind == sqz_pool_encoder ? "encoder" : "decoder",
+                       (uint64_t)u.head, (uint64_t)u.models,
+                       (uint64_t)u.chain, (uint64_t)u.block,
+                       (uint64_t)u.total);
+            }
+        }
+    }
+    return 0;
+}
+
+static errno_t bench_locate_corpus(void) { // see test.c locate_test_folder()
+    for (int32_t up = 0; up < 8; up++) { // MSVC bin/... folder depths
+        for (int32_t i = 0; i < countof(bench_corpus); i++) {
+            if (file_exist(bench_corpus[i])) { return 0; }
+        }
+        if (file_chdir("..") != 0) { return errno; }
+    }
+    printf("test/ corpus not found\n");
+    return ENOENT;
+}
+
+static int bench_usage(void) {
+    printf("usage: sqz_bench [-b backends] [-l levels] [-w window_bits]"
+           " [-t threads]\n                 [-k block_bits] [-r runs] [-a] [-m]"
+           " [-csv file] [-json file]\n                 [files...]"
+           " [text|logs|records|random:size[K|M|G]...]\n");
+    return EINVAL;
+}
+
+int main(int argc, const char* argv[]) {
+    const char* csv_fn = null;
+    const char* json_fn = null;
+    int32_t files = 0;
+    errno_t r = 0;
+    for (int i = 1; i < argc && r == 0; i++) {
+        const char* a = argv[i];
+        const char* v = i + 1 < argc ? argv[i + 1] : null;
+        if (a[0] != '-') {
+            argv[1 + files++] = a; // compact file names in place
+        } else if (strcmp(a, "-a") == 0) {
+            bench_analyze = true;
+        } else if (strcmp(a, "-m") == 0) {
+            bench_memory = true;
+        } else if (v == null) {
+            r = bench_usage();
+        } else {
+            i++;
+            struct bench_list list = {0};
+            if (strcmp(a, "-b") == 0) {
+                r = bench_parse(&bench_backends, v, sqz_range, sqz_split);
+            } else if (strcmp(a, "-l") == 0) {
+                r = bench_parse(&bench_levels, v, 0, sqz_max_level);
+            } else if (strcmp(a, "-w") == 0) {
+                r = bench_parse(&bench_windows, v, sqz_min_win_bits,
+                                sqz_chain_win_bits);
+            } else if (strcmp(a, "-t") == 0) {
+                r = bench_parse(&bench_threads, v, 1, bench_max_threads);
+            } else if (strcmp(a, "-k") == 0) {
+                r = bench_parse(&list, v, sqz_frame_min_block_bits,
+                                sqz_frame_max_block_bits);
+                bench_block_bits = list.value[0];
+            } else if (strcmp(a, "-r") == 0) {
+                r = bench_parse(&list, v, 1, bench_max_runs);
+                bench_runs = list.value[0];
+            } else if (strcmp(a, "-csv") == 0) {
+                csv_fn = v;
+            } else if (strcmp(a, "-json") == 0) {
+                json_fn = v;
+            } else {
+                r = bench_usage();
+            }
+            if (r != 0) { printf("invalid %s %s\n", a, v); }
+        }
+    }
+    if (r == 0 && bench_memory) { return bench_memory_usage(); }
+    // output files are created relative to the starting folder:
+    FILE* csv = null;
+    FILE* json = null;
+    if (r == 0 && csv_fn != null) {
+        csv = fopen(csv_fn, "w");
+        if (csv == null) { r = errno; printf("%s: %s\n", csv_fn, strerror(r)); }
+    }
+    if (r == 0 && json_fn != null) {
+        json = fopen(json_fn, "w");
+        if (json == null) { r = errno; printf("%s: %s\n", json_fn, strerror(r)); }
+    }
+    if (r == 0 && files == 0) { r = bench_locate_corpus(); }
+    if (r == 0) {
+        if (csv != null) {
+            fprintf(csv, "file,backend,level,window_bits,threads,jobs,filter,"
+                         "bytes,compressed,ratio,compress_mbs,"
+                         "decompress_mbs,peak,context\n");
+        }
+        if (json != null) { fprintf(json, "["); }
+        printf("%-14s %-7s %5s %6s %7s %8s %8s %7s %9s %9s %9s %8s\n",
+               "file", "backend", "level", "window", "threads", "bytes",
+               "packed", "ratio", "comp MB/s", "dec MB/s", "peak",
+               "context");
+        bool first = true;
+        if (files > 0) {
+            for (int32_t i = 0; i < files && r == 0; i++) {
+                r = bench_file(argv[1 + i], csv, json, &first);
+            }
+        } else {
+            for (int32_t i = 0; i < countof(bench_corpus) && r == 0; i++) {
+                if (file_exist(bench_corpus[i])) {
+                    r = bench_file(bench_corpus[i], csv, json, &first);
+                }
+            }
+        }
+        if (json != null) { fprintf(json, "\n]\n"); }
+    }
+    if (csv != null && fclose(csv) != 0 && r == 0) { r = errno; }
+    if (json != null && fclose(json) != 0 && r == 0) { r = errno; }
+    return r;
+}
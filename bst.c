@@ -1,80 +1,89 @@
 #include "rt/ustd.h"
+#include "rt/fileio.h"
+#define SQZ_INSTRUMENT     // map_best() probes are counted
+#define sqz_implementation // static match finders of sqz.c
+#include "shl/sqz/sqz.h"
 
-enum { sqz_min_size = 2, sqz_max_size = 254 };
-enum { sqz_max_win_bits = 16, sqz_max_win = 1u << sqz_max_win_bits };
+// Differential test of the match finders: brute force LZ77 search,
+// binary search tree, hash chain walked to the whole window, hash chain
+// of a compression level and map. Every finder is run over the same
+// input, queried at every position and fed every position, so that the
+// results can be compared position by position.
+//
+// Brute force is the oracle: longest match of bst_min_size..bst_max_size
+// bytes at the shortest distance 1..window - 1.
+// Exact finders must agree with it on (size, dist): tree always, hash
+// chain of full depth when the match is 3 bytes or longer (it is keyed by
+// 3 bytes prefix). Heuristic finders (chain of a level, map) must return
+// valid matches that are not longer than the oracle; how often they are
+// shorter and by how many bytes is reported as the cost of the
+// heuristic, together with ns and probes (nodes walked, candidates
+// compared, map lookups) per position.
+//
+// bst [-w window_bits] [-l level] [-n bytes] [files...]
+// Without files test/ corpus is used; each file is limited to n bytes
+// (default 256KB) because brute force is O(n * window).
 
-struct tree_node {
-    const  uint8_t*   data;
-    struct tree_node* ln; // left   node
-    struct tree_node* rn; // right  node
-    struct tree_node* pn; // parent node
+enum { bst_min_size = 2, bst_max_size = 254 };
+enum { bst_max_win_bits = 16, bst_max_win = 1u << bst_max_win_bits };
+
+struct bst_node {
+    const  uint8_t* data;
+    struct bst_node* ln; // left   node
+    struct bst_node* rn; // right  node
+    struct bst_node* pn; // parent node
 };
 
-struct tree {
-    struct tree_node* root;
-    struct tree_node  nodes[sqz_max_win];
+struct bst_tree {
+    struct bst_node* root;
+    struct bst_node  nodes[bst_max_win];
     size_t pos;
 };
 
-struct sqz {
-    size_t             window;
-    struct tree        tree;
+struct bst {
+    size_t          window; // number of nodes: positions i - window..i - 1
+    struct bst_tree tree;
 };
 
-static size_t tree_node_count(const struct tree_node* n) {
+static size_t tree_node_count(const struct bst_node* n) {
     return n == NULL ? 0 :
         1 + tree_node_count(n->ln) + tree_node_count(n->rn);
 }
 
-static void tree_print_node(char kind, const struct tree_node* n,
-        const struct tree_node* parent, size_t indent, const uint8_t* p) {
+static void tree_print_node(char kind, const struct bst_node* n,
+        const struct bst_node* parent, size_t indent, const uint8_t* p) {
     if (n != NULL) {
         for (size_t i = 0; i < indent; i++) printf(" ");
         const size_t distance = p - n->data; // from current position 'p'
         if (parent == NULL) {
-            printf("%c [%zu]'%s' %p\n", kind, distance, n->data, n->data);
+            printf("%c [%zu]'%.16s' %p\n", kind, distance, n->data, n->data);
         } else {
             const size_t pd = p - parent->data; // parent distance
-            printf("%c p:%zu [%zu]'%s' %p\n", kind, pd, distance, n->data, n->data);
+            printf("%c p:%zu [%zu]'%.16s' %p\n", kind, pd, distance, n->data, n->data);
         }
         tree_print_node('L', n->ln, n, indent + 1, p);
         tree_print_node('R', n->rn, n, indent + 1, p);
     }
 }
 
-static void tree_dump_node(const struct tree_node* n, const uint8_t* p) {
-    if (n != NULL) {
-        tree_dump_node(n->ln, p);
-        printf("[%2zu]'%s'\n", p - n->data, n->data);
-        tree_dump_node(n->rn, p);
-    }
-}
-
-static void tree_dump(const struct tree* t, const uint8_t* p) {
-    tree_dump_node(t->root, p);
-}
-
-static void tree_print(const struct tree* t, const uint8_t* p) {
+static void tree_print(const struct bst_tree* t, const uint8_t* p) {
     tree_print_node(' ', t->root, NULL, 0, p);
-    printf("\n");
-    tree_dump(t, p);
     printf("%zd nodes\n\n", tree_node_count(t->root));
 }
 
-
-static void tree_init(struct tree* t) {
+static void tree_init(struct bst_tree* t) {
     t->pos = 0;
     t->root = NULL;
     memset(t->nodes, 0, sizeof(t->nodes));
 }
 
-static inline struct tree_node* tree_successor(struct tree_node* n) {
+static inline struct bst_node* tree_successor(struct bst_node* n) {
     while (n->ln != NULL) { n = n->ln; }
     return n;
 }
 
-static void tree_shift_nodes(struct tree* t, struct tree_node* u,
-                                             struct tree_node* v) {
+static void tree_shift_nodes(struct bst_tree* t, struct bst_node* u,
+                                                 struct bst_node* v) {
     if (u->pn == NULL) {
         t->root = v;
     } else if (u == u->pn->ln) {
@@ -87,13 +96,13 @@ static void tree_shift_nodes(struct tree* t, struct tree_node* u,
     }
 }
 
-static void tree_delete_node(struct tree* t, struct tree_node* n) {
+static void tree_delete_node(struct bst_tree* t, struct bst_node* n) {
     if (n->ln == NULL) {
         tree_shift_nodes(t, n, n->rn);
     } else if (n->rn == NULL) {
         tree_shift_nodes(t, n, n->ln);
     } else {
-        struct tree_node* s = tree_successor(n->rn);
+        struct bst_node* s = tree_successor(n->rn);
         if (s->pn != n) {
             tree_shift_nodes(t, s, s->rn);
             s->rn = n->rn;
@@ -105,21 +114,21 @@ static void tree_delete_node(struct tree* t, struct tree_node* n) {
     }
 }
 
-static struct tree_node* tree_evict(struct sqz* s) {
-    struct tree* t = &s->tree;
-    struct tree_node* n = t->nodes + t->pos;
+static struct bst_node* tree_evict(struct bst* s) {
+    struct bst_tree* t = &s->tree;
+    struct bst_node* n = t->nodes + t->pos;
     t->pos = (t->pos + 1) % s->window;
     if (n->data != NULL) { tree_delete_node(t, n); }
     memset(n, 0, sizeof(*n));
     return n;
 }
 
-static inline void tree_insert(struct sqz* s, const uint8_t* p, size_t bytes) {
-    struct tree* t = &s->tree;
-    struct tree_node* z = tree_evict(s);
+static inline void tree_insert(struct bst* s, const uint8_t* p, size_t bytes) {
+    struct bst_tree* t = &s->tree;
+    struct bst_node* z = tree_evict(s);
     z->data = p;
-    struct tree_node* x = t->root;
-    struct tree_node* y = NULL;
+    struct bst_node* x = t->root;
+    struct bst_node* y = NULL;
     while (x != NULL) {
         y = x;
         int cmp = memcmp(p, x->data, bytes);
@@ -142,10 +151,10 @@ static inline void tree_insert(struct sqz* s, const uint8_t* p, size_t bytes) {
     }
 }
 
-static int tree_nodes_walked;
+static uint64_t tree_nodes_walked;
 
-static void tree_min_dist(const struct sqz* s,
-                          const struct tree_node* n, const uint8_t* p,
+static void tree_min_dist(const struct bst* s,
+                          const struct bst_node* n, const uint8_t* p,
                           size_t* best_size, size_t* best_dist) {
     if (n != NULL) {
         tree_nodes_walked++;
@@ -168,80 +177,71 @@ static void tree_min_dist(const struct sqz* s,
     }
 }
 
-static void tree_walk(const struct sqz* s,
-                      const struct tree_node* n, const uint8_t* p,
-                      size_t bytes,
+static void tree_walk(const struct bst* s,
+                      const struct bst_node* n, const uint8_t* p,
+                      size_t max_size,
                       size_t* best_size, size_t* best_dist) {
-    if (n != NULL) {
+    // max_size: [1..bst_max_size] bytes available at p
+    if (n != NULL && *best_size < max_size) {
         tree_nodes_walked++;
-        assert(bytes > 0);
-        if (*best_size < sqz_max_size) {
-            int cmp = memcmp(p, n->data, *best_size + 1);
-//          printf("memcmp(\"%.8s\", \"%.8s\", %zd): %d\n", p, n->data, *best_size + 1, cmp);
-            if (cmp == 0) {
-                const size_t dist = p - n->data;
-                const size_t max_size = bytes < sqz_max_size ? bytes : sqz_max_size;
-                while (*best_size < max_size && cmp == 0) {
-                    (*best_size)++;
-                    cmp = (int32_t)p[*best_size] - (int32_t)n->data[*best_size];
-                }
-                assert(memcmp(p, p - dist, *best_size) == 0);
-                *best_dist = dist;
-                assert(memcmp(p, p - *best_dist, *best_size) == 0);
-//              printf("best size: %zd dist: %zd\n", *best_size, *best_dist);
-                tree_walk(s, n->ln, p, bytes, best_size, best_dist);
-                tree_walk(s, n->rn, p, bytes, best_size, best_dist);
-            } else if (cmp < 0) {
-                tree_walk(s, n->ln, p, bytes, best_size, best_dist);
-            } else if (cmp > 0) {
-                tree_walk(s, n->rn, p, bytes, best_size, best_dist);
-            }
+        int cmp = memcmp(p, n->data, *best_size + 1);
+        if (cmp == 0) {
+            size_t k = *best_size + 1;
+            while (k < max_size && p[k] == n->data[k]) { k++; }
+            *best_size = k;
+            *best_dist = p - n->data;
+            assert(memcmp(p, p - *best_dist, *best_size) == 0);
+            tree_walk(s, n->ln, p, max_size, best_size, best_dist);
+            tree_walk(s, n->rn, p, max_size, best_size, best_dist);
+        } else if (cmp < 0) {
+            tree_walk(s, n->ln, p, max_size, best_size, best_dist);
+        } else {
+            tree_walk(s, n->rn, p, max_size, best_size, best_dist);
         }
     }
 }
 
 // returns the size of the longest match and the distance to it
-// size: [sqz_min_size..sqz_max_size]  dist: [1..window]
+// size: [bst_min_size..bst_max_size]  dist: [1..window]
 
-static inline void tree_find(const struct sqz* s, const uint8_t* p,
+static inline void tree_find(const struct bst* s, const uint8_t* p,
                              size_t bytes, size_t* size, size_t* dist) {
     assert(*size == 0); // callers responsibility
     assert(*dist == 0);
-    const struct tree* t = &s->tree;
-    tree_nodes_walked = 0;
+    const struct bst_tree* t = &s->tree;
     tree_walk(s, t->root, p, bytes, size, dist);
-    size_t walked = tree_nodes_walked;
-    if (sqz_min_size <= *size) {
-        assert(*size <= sqz_max_size);
-        tree_nodes_walked = 0;
+    if (bst_min_size <= *size) {
+        assert(*size <= bst_max_size);
         assert(memcmp(p, p - *dist, *size) == 0);
         tree_min_dist(s, t->root, p, size, dist);
         assert(memcmp(p, p - *dist, *size) == 0);
-//      printf("tree_walk(): %d tree_min_dist(): %d nodes\n",
-//              walked, tree_nodes_walked);
     } else {
-//      printf("tree_walk(): %d\n", walked);
+        *size = 0;
+        *dist = 0;
     }
 }
 
 // returns the size of the longest match and the distance to it
-// size: [sqz_min_size..sqz_max_size]  dist: [1..window]
+// size: [bst_min_size..bst_max_size]  dist: [1..window]
 
-static void lz77_find(const struct sqz* s, const uint8_t d[], size_t bytes, size_t i,
-                      size_t* size, size_t* dist) {
+static uint64_t lz77_compared;
+
+static void lz77_find(size_t window, const uint8_t d[], size_t bytes,
+                      size_t i, size_t* size, size_t* dist) {
     size_t len = 0;
     size_t dst = 0;
     if (i > 0) {
         size_t j = i - 1;
-        size_t min_j = i >= s->window ? i - s->window : 0;
+        size_t min_j = i >= window ? i - window : 0;
+        const size_t n = bytes - i > bst_max_size ? bst_max_size : bytes - i;
         for (;;) {
-            const size_t n = bytes - i > sqz_max_size ? sqz_max_size : bytes - i;
+            lz77_compared++;
             size_t k = 0;
             while (k < n && d[j + k] == d[i + k]) { k++; }
-            if (k >= sqz_min_size && k > len) {
+            if (k >= bst_min_size && k > len) {
                 len = k;
                 dst = i - j;
-                if (len == sqz_max_size) { break; }
+                if (len == n) { break; }
             }
             if (j == min_j) { break; }
             j--;
@@ -251,68 +251,170 @@ static void lz77_find(const struct sqz* s, const uint8_t d[], size_t bytes, size
     *dist = dst;
 }
 
-static void bst(size_t window, const uint8_t* d, size_t bytes) {
-    static struct sqz sqz;
-    struct sqz*  s = &sqz;
-    struct tree* t = &s->tree;
-    s->window = window;
-    printf("window: %zd\n", window);
-    tree_init(t);
-    size_t i = 0;
-    while (i < bytes) {
-        const size_t maximum = bytes - i < sqz_max_size ? bytes - i : sqz_max_size;
-        size_t best_dist = 0;
-        size_t best_size = 0;
-        tree_find(s, d + i, maximum, &best_size, &best_dist);
-//      printf("tree_find(\"%.16s\") size:%zd dist:%zd \"%.16s\"\n",
-//              d + i, best_size, best_dist, d + i - best_dist);
-        // LZ77:
-        size_t lz77_size = 0;
-        size_t lz77_dist = 0;
-        lz77_find(s, d, bytes, i, &lz77_size, &lz77_dist);
-        if (lz77_size >= sqz_min_size || best_size >= sqz_min_size) { // ignore single byte matches
-            const uint8_t* match0 = d + i - best_dist;
-            assert(memcmp(match0, d + i, best_size) == 0);
-            const uint8_t* match1 = d + i - lz77_dist;
-            if (best_dist != lz77_dist || best_size != lz77_size) {
-                printf("[%zu] '%.*s' %3zu:%zu tree\n", i, (int)best_size, match0, best_dist, best_size);
-                printf("[%zu] '%.*s' %3zu:%zu lz77\n", i, (int)lz77_size, match1, lz77_dist, lz77_size);
-                printf("tree_node_count(): %d\n", tree_node_count(t->root));
-                tree_print(t, d + i);
-                assert(best_dist == lz77_dist && best_size == lz77_size);
-            }
-            const size_t next = i + best_size;
-            while (i < next) {
-                tree_insert(s, d + i, maximum);
-                i++;
-                if (i < s->window && i != tree_node_count(t->root)) {
-                    printf("[%2zu] tree_node_count(t->root): %zu\n", i, tree_node_count(t->root));
-                }
-                if (i < s->window) {
-                    assert(i == tree_node_count(t->root));
-                } else {
-                    assert(s->window == tree_node_count(t->root));
-                }
-            }
+enum { // finders
+    bst_brute,  // oracle
+    bst_tree,
+    bst_chain,  // hash chain walked to the whole window
+    bst_level,  // hash chain of depth 2^(level - 1)
+    bst_map,
+    bst_finders
+};
+
+static const char* bst_name[bst_finders] = {
+    "brute", "tree", "chain", "level", "map"
+};
+
+struct bst_match {
+    uint32_t dist;
+    uint8_t  size;
+};
+
+struct bst_result {
+    uint64_t ns;
+    uint64_t probes;     // nodes walked, candidates compared, lookups
+    uint64_t matched;    // sum of sizes
+    uint64_t shorter;    // positions with shorter match than the oracle
+    uint64_t lost;       // bytes shorter than the oracle
+    uint64_t mismatches; // exact finder (size, dist) differs from oracle
+};
+
+static struct bst bst_state;
+
+static void bst_run(int32_t finder, size_t window_bits, int32_t level,
+                    const uint8_t* d, size_t bytes, struct bst_match* m,
+                    struct bst_result* r) {
+    const size_t window = (size_t)1 << window_bits;
+    struct sqz_params p;
+    sqz_params_init(&p);
+    p.window_bits = (int32_t)window_bits;
+    p.level = sqz_max_level; // carves hash chain
+    const size_t context = sqz_sizeof(&p);
+    void* memory = malloc(context);
+    struct map_entry* entry = null;
+    // map never reaches 75% full with 3 keys per position:
+    const size_t entries = bytes * 4 + 32;
+    if (finder == bst_map) {
+        entry = (struct map_entry*)malloc(entries * sizeof(entry[0]));
+    }
+    swear(memory != null && (finder != bst_map || entry != null));
+    struct sqz* s = sqz_init_with(memory, context, &p);
+    swear(s != null);
+    struct sqz_counters counters = {0};
+    s->rc.counters = &counters;
+    if (finder == bst_map) { map_init(s, entry, entries); }
+    chain_start(&s->chain, bytes);
+    struct bst* b = &bst_state;
+    b->window = window - 1;
+    tree_init(&b->tree);
+    const uint32_t depth = finder == bst_chain ? (uint32_t)window :
+                           1u << (level > 0 ? level - 1 : 0);
+    tree_nodes_walked = 0;
+    lz77_compared = 0;
+    uint64_t steps = 0;
+    const uint64_t start = sqz_trace_time();
+    for (size_t i = 0; i < bytes; i++) {
+        const size_t maximum = bytes - i < bst_max_size ? bytes - i : bst_max_size;
+        size_t size = 0;
+        size_t dist = 0;
+        if (finder == bst_brute) {
+            lz77_find(window - 1, d, bytes, i, &size, &dist);
+        } else if (finder == bst_tree) {
+            tree_find(b, d + i, maximum, &size, &dist);
+            tree_insert(b, d + i, maximum);
+        } else if (finder == bst_chain || finder == bst_level) {
+            uint32_t distance = 0;
+            uint8_t  n = 0;
+            steps += chain_best(&s->chain, d, i, bytes, (uint32_t)window,
+                                depth, &distance, &n);
+            chain_insert(&s->chain, d, i, bytes);
+            size = n;
+            dist = distance;
         } else {
-            tree_insert(s, d + i, maximum);
-            i++;
-            if (i < s->window) {
-                assert(i == tree_node_count(t->root));
-            } else {
-                assert(s->window == tree_node_count(t->root));
-            }
+            uint32_t distance = 0;
+            uint8_t  n = 0;
+            map_best(s, d + i, maximum, &distance, &n, (uint32_t)window);
+            if (n < bst_min_size && maximum >= 3) { map_put(s, d + i, 3); }
+            size = n;
+            dist = distance;
         }
+        if (size < bst_min_size) { size = 0; dist = 0; }
+        m[i].size = (uint8_t)size;
+        m[i].dist = (uint32_t)dist;
     }
-    printf("\n");
+    r->ns = sqz_trace_time() - start;
+    r->probes = lz77_compared + tree_nodes_walked + steps +
+                counters.map_probes + counters.map_steps;
+    free(entry);
+    free(memory);
 }
 
-static void test1(void) {
-    static const d[1024 * 1024]; // zeros
-    bst(sqz_max_win, d, sizeof(d));
+static errno_t bst_compare(int32_t finder, const uint8_t* d, size_t bytes,
+                           size_t window, const struct bst_match* oracle,
+                           const struct bst_match* m, struct bst_result* r) {
+    for (size_t i = 0; i < bytes; i++) {
+        const uint32_t size = m[i].size;
+        const uint32_t dist = m[i].dist;
+        const size_t maximum = bytes - i < bst_max_size ? bytes - i : bst_max_size;
+        const bool valid = size == 0 || (size >= bst_min_size &&
+            size <= maximum && dist >= 1 && dist < window && dist <= i &&
+            memcmp(d + i - dist, d + i, size) == 0);
+        if (!valid) {
+            printf("[%zu] %s %u:%u invalid match\n", i, bst_name[finder],
+                   dist, size);
+            return EILSEQ;
+        }
+        bool exact = false;
+        if (finder == bst_tree) {
+            exact = true;
+        } else if (finder == bst_chain) {
+            exact = oracle[i].size >= 3;
+        }
+        if (size > oracle[i].size ||
+            (exact && (size != oracle[i].size || dist != oracle[i].dist))) {
+            printf("[%zu] %s %u:%u brute %u:%u\n", i, bst_name[finder],
+                   dist, size, oracle[i].dist, oracle[i].size);
+            r->mismatches++;
+        }
+        r->matched += size;
+        if (size < oracle[i].size) {
+            r->shorter++;
+            r->lost += oracle[i].size - size;
+        }
+    }
+    return r->mismatches == 0 ? 0 : EILSEQ;
 }
 
-static void test2(void) {
+static errno_t bst(const char* name, const uint8_t* d, size_t bytes,
+                   size_t window_bits, int32_t level) {
+    const size_t window = (size_t)1 << window_bits;
+    struct bst_match* m[bst_finders];
+    struct bst_result r[bst_finders] = {0};
+    errno_t e = 0;
+    for (int32_t f = 0; f < bst_finders; f++) {
+        m[f] = (struct bst_match*)malloc((bytes + 1) * sizeof(m[f][0]));
+        if (m[f] == null) { e = ENOMEM; }
+    }
+    for (int32_t f = 0; f < bst_finders && e == 0; f++) {
+        bst_run(f, window_bits, level, d, bytes, m[f], &r[f]);
+        e = bst_compare(f, d, bytes, window, m[bst_brute], m[f], &r[f]);
+    }
+    if (e == 0) {
+        printf("%s: %zu bytes window: %zu level: %d\n",
+               name, bytes, window, level);
+        printf("finder  ns/pos probes/pos  avg size  shorter  lost bytes\n");
+        for (int32_t f = 0; f < bst_finders; f++) {
+            const double n = bytes > 0 ? (double)bytes : 1;
+            printf("%-6s %7.1f %10.2f %9.3f %7.3f%% %11lld\n",
+                   bst_name[f], r[f].ns / n, r[f].probes / n,
+                   r[f].matched / n, r[f].shorter * 100.0 / n, r[f].lost);
+        }
+        printf("\n");
+    }
+    for (int32_t f = 0; f < bst_finders; f++) { free(m[f]); }
+    return e;
+}
+
+static errno_t test_strings(void) {
     const char* str[] = {
         "abcabcdabcdeabcdefabcdefgabcdefabcdeabcd "
         "abcabcdabcdeabcdefabcdefgabcdefabcdeabcd",
@@ -337,28 +439,80 @@ static void test2(void) {
         "The First Book of the Chronicles "
         "The Second Book of the Chronicles "
     };
-    for (size_t k = 0; k < sizeof(str) / sizeof(str[0]); k++) {
+    static uint8_t zeros[64 * 1024];
+    errno_t e = bst("zeros", zeros, sizeof(zeros), sqz_min_win_bits,
+                    sqz_default_level);
+    for (size_t k = 0; k < countof(str) && e == 0; k++) {
         const size_t bytes = strlen(str[k]);
         const uint8_t* d = (const uint8_t*)str[k];
-
-        printf("%.*s: %zu\n", (int)bytes, str[k], bytes);
-        for (size_t i = 0; i < bytes; i++) {
-            printf("%d", i % 10);
-        }
-        printf("\n");
-        for (size_t i = 0; i < bytes; i++) {
-            printf("%c", i % 10 == 0 ? '0' + (i / 10) % 10 : 0x20);
-        }
-        printf("\n");
-        for (size_t window = 8; window <= sqz_max_win; window <<= 1) {
-            bst(window, d, bytes);
+        char name[32];
+        snprintf(name, sizeof(name), "\"%.16s...\"", str[k]);
+        for (size_t w = sqz_min_win_bits; w <= bst_max_win_bits && e == 0; w += 6) {
+            e = bst(name, d, bytes, w, sqz_default_level);
         }
     }
+    return e;
+}
+
+static const char* bst_corpus[] = {
+    "test/bible.txt",
+    "test/hhgttg.txt",
+    "test/confucius.txt",
+    "test/laozi.txt",
+    "test/sqlite3.c",
+    "test/arm64.elf",
+    "test/x64.elf",
+    "test/mandrill.bmp",
+    "test/mandrill.png",
+};
+
+static errno_t test_file(const char* fn, size_t limit, size_t window_bits,
+                         int32_t level) {
+    const uint8_t* data = null;
+    size_t bytes = 0;
+    errno_t e = file_read_fully(fn, &data, &bytes);
+    if (e == 0) {
+        e = bst(fn, data, bytes < limit ? bytes : limit, window_bits, level);
+        free((void*)data);
+    }
+    return e;
 }
 
 int main(int argc, const char* argv[]) {
-    (void)argc; (void)argv; // unused
-//  test1();
-    test2();
-    return 0;
+    size_t  window_bits = 12;
+    int32_t level = sqz_default_level;
+    size_t  limit = 256 * 1024;
+    int32_t files = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            window_bits = (size_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            level = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            limit = (size_t)atoll(argv[++i]);
+        } else {
+            argv[1 + files++] = argv[i];
+        }
+    }
+    if (window_bits < sqz_min_win_bits || window_bits > sqz_chain_win_bits ||
+        level < 1 || level > sqz_max_level) {
+        printf("usage: bst [-w %d..%d] [-l 1..%d] [-n bytes] [files...]\n",
+               sqz_min_win_bits, sqz_chain_win_bits, sqz_max_level);
+        return EINVAL;
+    }
+    errno_t e = test_strings();
+    for (int32_t i = 0; i < files && e == 0; i++) {
+        e = test_file(argv[1 + i], limit, window_bits, level);
+    }
+    for (int32_t up = 0; up < 8 && files == 0; up++) { // find test/ folder
+        bool found = false;
+        for (int32_t i = 0; i < countof(bst_corpus) && e == 0; i++) {
+            if (file_exist(bst_corpus[i])) {
+                found = true;
+                e = test_file(bst_corpus[i], limit, window_bits, level);
+            }
+        }
+        if (found || file_chdir("..") != 0) { break; }
+    }
+    return e;
 }
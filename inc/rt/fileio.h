@@ -15,16 +15,27 @@
 #include <unistd.h> // chdir
 #endif
 
+// xxHash64 https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+// 4 independent 64-bit lanes consume 32 bytes per round.
+
+struct checksum {
+    uint64_t lane[4];
+    uint64_t bytes;    // total number of appended bytes
+    uint8_t  tail[32]; // bytes not yet consumed by lanes
+    uint32_t pending;  // number of bytes in tail[]
+};
+
 // input/output to file or memory:
 
 struct io { // either memory or file i/o:
+    // checksum covers every byte that passes through io_write()/io_read()
     uint8_t* data;
     size_t   capacity;
     size_t   allocated;
     FILE*    file;
     uint64_t bytes;    // number of bytes read by read_byte()
     uint64_t written;  // number of bytes written by write_byte()
-    uint64_t checksum; // FNV hash of put()/get() single byte io
+    struct checksum checksum; // of all bytes written or read
     int32_t  error;    // sticky
     bool     fail_fast;
 };
@@ -35,8 +46,11 @@ static errno_t file_size(FILE* f, size_t* size);
 static errno_t file_read_fully(const char* fn, const uint8_t* *data,
                                size_t *bytes);
 
-static uint64_t checksum_init(void); // FNV-1a offset basis
-static uint64_t checksum_append(uint64_t checksum, const uint8_t byte);
+static void     checksum_init(struct checksum* c);
+static void     checksum_append(struct checksum* c, const void* data,
+                                size_t bytes);
+static uint64_t checksum_final(const struct checksum* c);
+static uint64_t checksum64(const void* data, size_t bytes); // one shot
 
 static void     io_init(struct io* io);
 static void     io_init_with(struct io* io, void* data, size_t bytes);
@@ -46,8 +60,8 @@ static void     io_create(struct io* io, const char* filename);
 static void     io_rewind(struct io* io);
 static void     io_write(struct io* io, void* data, size_t bytes);
 static void     io_read(struct io* io, void* data, size_t bytes);
-static void     io_put(struct io* io, uint8_t b); // accumulates checksum
-static uint8_t  io_get(struct io* io);            // accumulates checksum
+static void     io_put(struct io* io, uint8_t b);
+static uint8_t  io_get(struct io* io);
 static uint64_t io_get64(struct io* io);
 static void     io_put64(struct io* io, uint64_t v);
 static void     io_read_fully(struct io* io, const char* fn);
@@ -115,22 +129,125 @@ static errno_t file_chdir(const char* name) {
     }                               \
 } while (0)
 
-// https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
+static const uint64_t checksum_p1 = 0x9E3779B185EBCA87uLL;
+static const uint64_t checksum_p2 = 0xC2B2AE3D27D4EB4FuLL;
+static const uint64_t checksum_p3 = 0x165667B19E3779F9uLL;
+static const uint64_t checksum_p4 = 0x85EBCA77C2B2AE63uLL;
+static const uint64_t checksum_p5 = 0x27D4EB2F165667C5uLL;
+
+static inline uint64_t checksum_rotl(uint64_t v, int32_t n) {
+    return (v << n) | (v >> (64 - n));
+}
+
+static inline uint64_t checksum_load64(const uint8_t* p) { // little endian
+    uint64_t v = 0;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t checksum_round(uint64_t lane, uint64_t v) {
+    lane += v * checksum_p2;
+    return checksum_rotl(lane, 31) * checksum_p1;
+}
+
+static inline uint64_t checksum_merge(uint64_t h, uint64_t lane) {
+    h ^= checksum_round(0, lane);
+    return h * checksum_p1 + checksum_p4;
+}
+
+static const uint8_t* checksum_lanes(uint64_t lane[4], const uint8_t* p,
+                                     const uint8_t* end) {
+    // consumes whole 32 byte stripes, returns start of the rest
+    uint64_t v0 = lane[0], v1 = lane[1], v2 = lane[2], v3 = lane[3];
+    while (end - p >= 32) {
+        v0 = checksum_round(v0, checksum_load64(p +  0));
+        v1 = checksum_round(v1, checksum_load64(p +  8));
+        v2 = checksum_round(v2, checksum_load64(p + 16));
+        v3 = checksum_round(v3, checksum_load64(p + 24));
+        p += 32;
+    }
+    lane[0] = v0; lane[1] = v1; lane[2] = v2; lane[3] = v3;
+    return p;
+}
+
+static uint64_t checksum_finish(const uint64_t lane[4], uint64_t bytes,
+                                const uint8_t* p, size_t n) {
+    // n < 32 tail bytes
+    uint64_t h = 0;
+    if (bytes >= 32) {
+        h = checksum_rotl(lane[0], 1) + checksum_rotl(lane[1], 7) +
+            checksum_rotl(lane[2], 12) + checksum_rotl(lane[3], 18);
+        for (int i = 0; i < 4; i++) { h = checksum_merge(h, lane[i]); }
+    } else {
+        h = lane[2] + checksum_p5; // lane[2] is the seed
+    }
+    h += bytes;
+    while (n >= 8) {
+        h ^= checksum_round(0, checksum_load64(p));
+        h = checksum_rotl(h, 27) * checksum_p1 + checksum_p4;
+        p += 8; n -= 8;
+    }
+    if (n >= 4) {
+        uint32_t v = 0;
+        memcpy(&v, p, sizeof(v));
+        h ^= (uint64_t)v * checksum_p1;
+        h = checksum_rotl(h, 23) * checksum_p2 + checksum_p3;
+        p += 4; n -= 4;
+    }
+    while (n > 0) {
+        h ^= *p * checksum_p5;
+        h = checksum_rotl(h, 11) * checksum_p1;
+        p++; n--;
+    }
+    h ^= h >> 33; h *= checksum_p2;
+    h ^= h >> 29; h *= checksum_p3;
+    h ^= h >> 32;
+    return h;
+}
+
+static void checksum_init(struct checksum* c) { // seed = 0
+    memset(c, 0, sizeof(*c));
+    c->lane[0] = checksum_p1 + checksum_p2;
+    c->lane[1] = checksum_p2;
+    c->lane[2] = 0;
+    c->lane[3] = 0 - checksum_p1;
+}
+
+static void checksum_append(struct checksum* c, const void* data,
+                            size_t bytes) {
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + bytes;
+    c->bytes += bytes;
+    if (c->pending > 0) { // fill the tail first
+        size_t n = sizeof(c->tail) - c->pending;
+        if (n > bytes) { n = bytes; }
+        memcpy(c->tail + c->pending, p, n);
+        c->pending += (uint32_t)n;
+        p += n;
+        if (c->pending < sizeof(c->tail)) { return; }
+        checksum_lanes(c->lane, c->tail, c->tail + sizeof(c->tail));
+        c->pending = 0;
+    }
+    p = checksum_lanes(c->lane, p, end);
+    memcpy(c->tail, p, (size_t)(end - p));
+    c->pending = (uint32_t)(end - p);
+}
 
-static uint64_t checksum_init(void) {
-    return 0xCBF29CE484222325uLL; // FNV offset basis
+static uint64_t checksum_final(const struct checksum* c) {
+    return checksum_finish(c->lane, c->bytes, c->tail, c->pending);
 }
 
-static uint64_t checksum_append(uint64_t checksum, const uint8_t byte) {
-    checksum ^= byte;
-    checksum *= 0x100000001B3; // FNV prime
-    checksum ^= (checksum >> 32);
-    return (checksum << 7) | (checksum >> (64 - 7));
+static uint64_t checksum64(const void* data, size_t bytes) {
+    struct checksum c;
+    checksum_init(&c);
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* rest = checksum_lanes(c.lane, p, p + bytes);
+    return checksum_finish(c.lane, bytes, rest, (size_t)(p + bytes - rest));
 }
 
 static void io_init(struct io* io) {
     memset(io, 0, sizeof(*io));
-    io->checksum = checksum_init();
+    checksum_init(&io->checksum);
 }
 
 static void io_init_with(struct io* io, void* data, size_t bytes) {
@@ -190,7 +307,10 @@ static void io_write(struct io* io, void* data, size_t bytes) {
         io->error = EINVAL;
     }
     io_fail_fast(io);
-    if (io->error == 0) { io->written += bytes; }
+    if (io->error == 0) {
+        checksum_append(&io->checksum, data, bytes);
+        io->written += bytes;
+    }
 }
 
 static void io_read(struct io* io, void* data, size_t bytes) {
@@ -206,16 +326,16 @@ static void io_read(struct io* io, void* data, size_t bytes) {
         io->error = EINVAL;
     }
     io_fail_fast(io);
-    if (io->error == 0) { io->bytes += bytes; }
+    if (io->error == 0) {
+        checksum_append(&io->checksum, data, bytes);
+        io->bytes += bytes;
+    }
 }
 
 static void io_put(struct io* io, uint8_t b) {
     if (io->error == 0) {
         io_write(io, &b, sizeof(b));
     }
-    if (io->error == 0) {
-        io->checksum = checksum_append(io->checksum, b);
-    }
 }
 
 static uint8_t io_get(struct io* io) {
@@ -223,9 +343,6 @@ static uint8_t io_get(struct io* io) {
     if (io->error == 0) {
         io_read(io, &b, sizeof(b));
     }
-    if (io->error == 0) {
-        io->checksum = checksum_append(io->checksum, b);
-    }
     return b;
 }
 
@@ -9,6 +9,23 @@ enum {
     sqz_max_win_bits  =  15
 };
 
+enum {
+    sqz_max_block_bits = 16,
+    sqz_max_block      = 1u << sqz_max_block_bits
+};
+
+enum { // sqz.backend entropy coder of the blocks written by sqz_compress()
+    sqz_range   = 0, // adaptive range coder (default, best ratio)
+    sqz_huffman = 1, // static canonical Huffman (fastest decoding)
+    sqz_rans    = 2, // static interleaved rANS (fast, closer to range)
+    sqz_split   = 3  // range coder per symbol class sub-stream
+};
+
+enum { // sqz.level match finder effort: hash chain depth 2^(level - 1)
+    sqz_max_level     = 9,
+    sqz_default_level = 6  // 0: rep matches only
+};
+
 // See: posix errno.h https://pubs.opengroup.org/onlinepubs/9699919799/
 // Range coder errors can be any values != 0 but for the convenience
 // of debugging (e.g. strerror()) and testing de facto
@@ -38,8 +55,49 @@ struct tree {
 
 
 struct prob_model  { // probability model
-    uint64_t freq[256];
-    uint64_t tree[256]; // Fenwick Tree (aka BITS)
+    uint64_t* freq;     // [n]
+    uint64_t* tree;     // [n] Fenwick Tree (aka BITS)
+    uint32_t  n;        // power of 2 >= number of symbols
+    uint32_t  id;       // sqz_model_run..sqz_model_rep
+};
+
+// Instrumentation: builds with SQZ_INSTRUMENT defined count the work of
+// match finders, range coder and i/o into sqz.rc.counters supplied by
+// caller (null: nothing is counted). Without SQZ_INSTRUMENT counting
+// compiles to nothing. Time stamp counter ticks (nanoseconds where there
+// is none) are accumulated per stage. Literal and matched source bytes
+// are counted by sqz_stats.
+
+enum { // prob_model.id
+    sqz_model_run  = 0,
+    sqz_model_size = 1,
+    sqz_model_byte = 2, // all UTF-8 contexts
+    sqz_model_bits = 3,
+    sqz_model_dist = 4, // all bits of distance
+    sqz_model_rep  = 5,
+    sqz_models     = 6
+};
+
+enum { // sqz_counters.ticks[]
+    sqz_stage_find   = 0, // sqz_compress() except coding of blocks
+    sqz_stage_encode = 1, // entropy coding and writing of blocks
+    sqz_stage_decode = 2, // reading and decoding of blocks
+    sqz_stage_filter = 3, // filter decoding of frame blocks
+    sqz_stages       = 4
+};
+
+struct sqz_counters {
+    uint64_t chain_probes;        // chain_best() lookups
+    uint64_t chain_steps;         // candidates compared by chain_best()
+    uint64_t map_probes;          // map lookups by map_best()
+    uint64_t map_steps;           // collisions passed by map_put()
+    uint64_t encodes[sqz_models]; // rc_encode() calls
+    uint64_t decodes[sqz_models]; // rc_decode() calls
+    uint64_t emits;               // renormalization bytes out of coder
+    uint64_t consumes;            // renormalization bytes into coder
+    uint64_t written;             // bytes passed to sqz.rc.write()
+    uint64_t read;                // bytes returned by sqz.rc.read()
+    uint64_t ticks[sqz_stages];
 };
 
 struct range_coder {
@@ -48,6 +106,7 @@ struct range_coder {
     uint64_t code;
     void    (*write)(struct range_coder*, uint8_t);
     uint8_t (*read)(struct range_coder*);
+    struct sqz_counters* counters; // SQZ_INSTRUMENT builds only
     int32_t  error; // sticky error (e.g. errno_t from read/write)
     int32_t  padding;
 };
@@ -55,7 +114,8 @@ struct range_coder {
 struct map_entry {
     const uint8_t* data;
     uint64_t hash;
-    int32_t  bytes; // 0 empty, -1 removed
+    int32_t  bytes;      // -1 removed
+    uint32_t generation; // empty if != map.generation
 };
 
 struct map {
@@ -64,18 +124,110 @@ struct map {
     uint32_t entries;
     uint32_t max_chain;
     uint32_t max_bytes;
+    uint32_t generation; // of the live entries, never 0
+    uint32_t padding;
+};
+
+enum { sqz_chain_win_bits = 16 };
+
+struct chain { // hash chain match finder
+    uint32_t* head;   // [1 << bits] base + position + 1, <= base empty
+    uint32_t* prev;   // [window]
+    uint32_t  bits;   // of hash
+    uint32_t  window; // power of 2
+    uint32_t  base;   // added to positions of the current stream
+    uint32_t  end;    // base + bytes of the longest stream since reset
+};
+
+struct sqz_block { // LZ tokens of a single block split by symbol class
+    uint8_t*  run;    // [capacity] literal run lengths, 255: continues
+    uint8_t*  byte;   // [capacity] literals
+    uint8_t*  size;   // [capacity / 2] back reference sizes
+    uint8_t*  rep;    // [capacity / 2] see pm_rep
+    uint8_t*  bits;   // [capacity / 2] number of bits in distance
+    uint32_t* dist;   // [capacity / 2] distance for rep == 0
+    uint8_t*  data;   // [capacity] encoded block payload
+    uint32_t capacity; // power of 2 <= sqz_max_block
+    uint32_t runs;
+    uint32_t bytes;
+    uint32_t sizes; // also number of reps
+    uint32_t dists; // also number of bits
+    uint32_t run_start;               // bytes at the start of literal run
+    uint32_t rep_start[4];            // sqz.rep[] at the start of block
 };
 
+struct sqz_stats { // accumulated by sqz_compress() when sqz.stats != null
+    uint64_t literals;          // source bytes coded as literals or stored
+    uint64_t matched;           // source bytes coded as back references
+    uint64_t rejections;        // back references too costly to code
+    uint64_t rep_matches;       // back references coded as rep[]
+    uint64_t map_matches;       // found by map_best()
+    uint64_t map_distance;      // sum of map_best() distances
+    uint64_t map_size;          // sum of map_best() sizes
+    uint64_t size[256];         // back references by size
+    uint64_t distance_bits[32]; // back references by bits in distance
+};
+
+// Trace: timeline of frame blocks for Chrome trace event viewers
+// (chrome://tracing, ui.perfetto.dev). Each thread attaches its own
+// trace to the context it uses (sqz.trace, null: no tracing) and sets
+// trace.tid. Compression records find and encode phases of every block
+// of tokens, store and checksum of frame blocks. Decompression records
+// decode, checksum and filter of frame blocks. Caller adds own events
+// (e.g. sqz_phase_wait for work queue or sqz_pool) with sqz_trace_add().
+// Events that do not fit into capacity are counted as dropped.
+
+enum {
+    sqz_phase_find     = 0, // match finding of a block of tokens
+    sqz_phase_encode   = 1, // entropy coding and writing of tokens
+    sqz_phase_store    = 2, // incompressible block written as is
+    sqz_phase_checksum = 3, // xxHash64 of frame block
+    sqz_phase_decode   = 4, // reading and decoding of frame block
+    sqz_phase_filter   = 5, // filter decoding of frame block
+    sqz_phase_wait     = 6, // added by caller
+    sqz_phases         = 7
+};
+
+struct sqz_trace_event {
+    uint64_t start;  // sqz_trace_time() nanoseconds
+    uint64_t end;
+    uint64_t in;     // bytes
+    uint64_t out;    // bytes, 0 if not known
+    uint32_t block;  // frame block
+    int32_t  phase;  // sqz_phase_find..sqz_phase_wait
+};
+
+struct sqz_trace {
+    struct sqz_trace_event* event; // [capacity]
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t dropped;
+    uint32_t tid;    // thread id of exported events
+    uint32_t block;  // frame block of the events that follow
+    uint32_t padding;
+    uint64_t mark;   // end of the last event
+};
+
+// struct sqz is the head of the context memory, arrays it points to are
+// sized by sqz_params, see sqz_sizeof() and sqz_init_with().
+
 struct sqz {
     struct range_coder rc;
     void*  that;                    // convenience for caller i/o override
-    struct tree        tree;
-    struct prob_model  pm_literal;  // 0..1
+    struct sqz_stats* stats;        // null or caller's (opt-in) statistics
+    struct sqz_trace* trace;        // null or caller's (opt-in) timeline
+    int32_t backend;                // sqz_range, sqz_huffman, sqz_rans...
+    int32_t level;                  // 0..sqz_max_level
+    struct prob_model  pm_run;      // literal run length: 0..255
     struct prob_model  pm_size;     // size: 0..255
-    struct prob_model  pm_byte;     // single byte
+    struct prob_model  pm_byte[6];  // literal in UTF-8 context
     struct prob_model  pm_bits;     // 0..31 number of bits in distance
     struct prob_model  pm_dist[32]; // 0..1 per bit distance probability
+    struct prob_model  pm_rep;      // 0: pm_bits follow, 1..4: rep[0..3]
+    uint32_t           rep[4];      // most recently used distances
     struct map         map;         // caller supplied memory for map
+    struct chain       chain;
+    struct sqz_block   block;
 };
 
 static_assert(offsetof(struct sqz, rc) == 0, "rc must be first field of sqz");
@@ -84,10 +236,192 @@ static_assert(offsetof(struct sqz, rc) == 0, "rc must be first field of sqz");
 extern "C" {
 #endif
 
+// sqz_init() resets context made by sqz_init_with() to initial state
 void     sqz_init(struct sqz* s, struct map_entry entry[], size_t n);
+// sqz_reset() prepares context for the next stream without clearing
+// the map and match finder memory: their entries from previous streams
+// are invalidated by generation. Keeps backend, level, map, that, read,
+// write, counters, stats and trace. Costs microseconds regardless of
+// window and map size.
+void     sqz_reset(struct sqz* s);
 void     sqz_compress(struct sqz* s, const void* d, size_t b, uint32_t window);
 uint64_t sqz_decompress(struct sqz* s, void* data, size_t bytes);
 
+// Frame: self-contained memory to memory container.
+// Blocks of 2^block_bits source bytes are compressed independently
+// (each as sqz_compress() stream from freshly initialized context)
+// so they can be compressed, decompressed and verified separately.
+//
+// header (little endian, sqz_frame_header bytes):
+//   magic "sqzF", version, window_bits, level, block_bits, backend,
+//   filter, stride, reserved zero byte, uint64_t source bytes,
+//   uint32_t blocks, uint32_t row
+// block table (sqz_frame_entry bytes per block):
+//   uint32_t compressed bytes | stored bit, uint64_t xxHash64
+//   of block source bytes
+// compressed blocks in order.
+//
+// Frame functions use sqz only as working memory: that, rc.read and
+// rc.write are overwritten. Errors are returned in s->rc.error.
+
+enum {
+    sqz_frame_version        =  5,
+    sqz_frame_header         = 28,
+    sqz_frame_entry          = 12,
+    sqz_frame_stored_bit     = 31, // block is stored as is
+    sqz_frame_min_block_bits = 10,
+    sqz_frame_max_block_bits = 30
+};
+
+// Filters are reversible in place transforms of the source that make it
+// more compressible. Branch converting (BCJ) filters replace relative
+// call/branch targets of executables with absolute ones, so repeated
+// calls to the same function become identical byte sequences.
+// Delta, Paeth and shuffle filters work on fixed size elements of
+// `stride` bytes (pixels, channels, numeric fields of records):
+// delta subtracts the byte of previous element, Paeth predicts each byte
+// of a raster with `row` bytes per scan line from its left, up and
+// up-left neighbours (as PNG does) and shuffle transposes elements into
+// byte planes in 16KB tiles so that similar high bytes of numbers are
+// adjacent.
+// Filters restart at each frame block. Caller applies sqz_filter_encode()
+// to the source before sqz_frame_compress(); sqz_frame_decompress() and
+// sqz_decompress_range() undo the filter recorded in the frame.
+
+enum {
+    sqz_filter_none    = 0,
+    sqz_filter_x86     = 1, // E8 call, E9 jmp rel32
+    sqz_filter_arm64   = 2, // B, BL imm26 and ADRP
+    sqz_filter_delta   = 3, // d[i] - d[i - stride]
+    sqz_filter_paeth   = 4, // 2D prediction, row >= stride
+    sqz_filter_shuffle = 5, // byte planes of stride bytes elements
+    sqz_max_stride     = 255
+};
+
+enum { // sqz_params.backend and .level chosen per block by entropy
+    sqz_auto = -1
+};
+
+struct sqz_params {
+    int32_t window_bits; // sqz_min_win_bits..sqz_chain_win_bits
+    int32_t level;       // 0..sqz_max_level or sqz_auto
+    int32_t block_bits;  // sqz_frame_min_block_bits..sqz_frame_max_block_bits
+    int32_t backend;     // sqz_range..sqz_split or sqz_auto
+    int32_t filter;      // sqz_filter_none..sqz_filter_shuffle
+    int32_t stride;      // 1..sqz_max_stride bytes per element
+    int32_t row;         // bytes per scan line for sqz_filter_paeth
+};
+
+struct sqz_frame_info {
+    struct sqz_params params;
+    uint64_t bytes;  // source bytes
+    uint32_t blocks;
+};
+
+void     sqz_params_init(struct sqz_params* p); // defaults
+
+// Context memory of sqz_sizeof(p) bytes is sized by window_bits,
+// block_bits and level (0 has no match finder: decoder only or rep
+// matches). Memory must be 8 bytes aligned, contexts can be used with
+// parameters that do not exceed the ones they were made with.
+// sqz_init_with() returns null for invalid parameters or small memory.
+
+size_t      sqz_sizeof(const struct sqz_params* p); // 0 if p is invalid
+struct sqz* sqz_init_with(void* memory, size_t size,
+                          const struct sqz_params* p);
+
+// Pool of n encoder and n decoder (level 0) contexts for threads that
+// compress and decompress concurrently without allocations or locks.
+// Free contexts of each kind are kept in a lock free stack and every
+// thread caches the last released context of each kind, so that the
+// next acquire does not touch shared memory at all.
+// sqz_pool_acquire() returns null when all contexts are in use.
+// sqz_pool_release() resets the context with sqz_reset(), restores
+// backend and level of the pool parameters, detaches stats, counters
+// and trace.
+// A thread must sqz_pool_flush() before it exits, otherwise contexts
+// it cached are lost to the pool.
+
+enum { sqz_pool_encoder = 0, sqz_pool_decoder = 1 };
+
+struct sqz_pool {
+    uint8_t*  context[2]; // [kind] n contexts, 64 bytes aligned
+    size_t    size[2];    // [kind] bytes per context, multiple of 64
+    uint32_t* next;       // [2 * n] index + 1 of the next free context
+    uint64_t  top[2];     // [kind] of free stack: tag << 32 | index + 1
+    uint64_t  id;         // tells apart pools made in the same memory
+    struct sqz_params params;
+    uint32_t  n;
+};
+
+size_t      sqz_pool_sizeof(const struct sqz_params* p, uint32_t n);
+int32_t     sqz_pool_init(struct sqz_pool* pool, void* memory, size_t size,
+                          const struct sqz_params* p, uint32_t n); // errno
+struct sqz* sqz_pool_acquire(struct sqz_pool* pool, int32_t kind);
+void        sqz_pool_release(struct sqz_pool* pool, struct sqz* s);
+void        sqz_pool_flush(struct sqz_pool* pool);
+
+// Exact memory of a context of the kind (sqz_pool_encoder or
+// sqz_pool_decoder that is level 0) for the parameters, by part.
+// The map is the only memory outside of the context: map_entries is
+// the n of sqz_init() entries caller keeps per encoder (0 for none).
+// Frame functions allocate nothing, callers of them also keep
+// sqz_frame_bound() bytes of frame per stream.
+
+struct sqz_memory_usage { // bytes
+    size_t head;   // struct sqz
+    size_t models; // probability models
+    size_t chain;  // hash chain match finder, 0 at level 0
+    size_t block;  // LZ tokens and encoded payload of a block
+    size_t map;    // map_entries * sizeof(struct map_entry)
+    size_t total;  // sqz_sizeof() + map
+};
+
+int32_t     sqz_memory_usage(const struct sqz_params* p, int32_t kind,
+                             size_t map_entries,
+                             struct sqz_memory_usage* u); // 0 or errno
+
+// Samples the source (entropy, correlation of bytes stride apart, E8/E9
+// and BL opcode density, UTF-8 validity, ELF/PE/BMP headers) and sets
+// filter, stride, row and sqz_auto backend and level of parameters:
+void     sqz_analyze(const void* data, size_t bytes, struct sqz_params* p);
+size_t   sqz_frame_bound(const struct sqz_params* p, size_t bytes);
+void     sqz_filter_encode(const struct sqz_params* p, void* data, size_t bytes);
+void     sqz_filter_decode(const struct sqz_params* p, void* data, size_t bytes);
+size_t   sqz_frame_compress(struct sqz* s, const struct sqz_params* p,
+                            const void* data, size_t bytes,
+                            void* frame, size_t capacity);
+// sqz_frame_info() validates header and block table against the frame
+// bytes: EILSEQ if it is not a frame, ENOSYS for other versions, EINVAL
+// for truncated frame or inconsistent header (block count that does not
+// match source bytes, block table or blocks past the end of the frame).
+// Frame decompression functions return these errors in s->rc.error.
+int32_t  sqz_frame_info(const void* frame, size_t bytes,
+                        struct sqz_frame_info* info); // 0 or errno
+size_t   sqz_frame_decompress(struct sqz* s, const void* frame, size_t bytes,
+                              void* data, size_t capacity);
+
+// Decompresses source bytes [offset..offset + length) of the frame into
+// data[length] decoding only the blocks that cover the range. Blocks
+// are not decoded past the end of the range. Only fully covered blocks
+// are verified by checksum. scratch[2^block_bits] is required when range
+// is not aligned to blocks and may be null otherwise.
+// Returns number of bytes decompressed (length clipped at source end).
+
+size_t   sqz_decompress_range(struct sqz* s, const void* frame, size_t bytes,
+                              uint64_t offset, size_t length,
+                              void* data, void* scratch);
+
+uint64_t sqz_trace_time(void); // nanoseconds of monotonic enough clock
+// adds event of phase from start to sqz_trace_time() to trace.block:
+void     sqz_trace_add(struct sqz_trace* t, int32_t phase, uint64_t start,
+                       uint64_t in, uint64_t out);
+// Writes events of n traces as Chrome trace event JSON with timestamps
+// relative to the first event. Returns length of JSON (without zero
+// terminator) even if it does not fit into capacity, as snprintf() does.
+size_t   sqz_trace_json(struct sqz_trace* const trace[], size_t n,
+                        char* json, size_t capacity);
+
 // Because in C arrays are indexed by both positive and negative index values
 // for the simplicity of memory handling the compress/decompress is limited
 // to less than 2 ^ (sizeof(size_t) * 8 - 1) bytes.
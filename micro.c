@@ -0,0 +1,299 @@
+#include "rt/ustd.h"
+#define sqz_implementation // static primitives of sqz.c are benchmarked
+#include "shl/sqz/sqz.h"
+
+// Micro benchmarks of the inner loop primitives of sqz.c: Fenwick tree,
+// probability model, range coder and map. Symbols are drawn from uniform,
+// geometric and Zipf distributions over 256 values by a deterministic
+// generator; every primitive is timed over micro_symbols calls and the
+// median of micro_runs runs is reported in nanoseconds per symbol.
+// Map keys are 4 bytes at every position of the symbol sequence and
+// map_best() is given the rest of the sequence, as sqz_compress() does.
+
+enum {
+    micro_symbols = 1u << 20,
+    micro_runs    = 7,
+    micro_key     = 4,         // map key bytes
+    micro_entries = 1u << 21,  // map entries (never 75% full)
+    micro_window  = 1u << 16
+};
+
+enum { micro_uniform, micro_geometric, micro_zipf, micro_distributions };
+
+static const char* micro_name[micro_distributions] = {
+    "uniform", "geometric", "zipf"
+};
+
+struct micro {
+    uint8_t  sym[micro_symbols];
+    uint64_t sum[micro_symbols];     // ft_index_of() arguments
+    uint64_t hash[micro_symbols];    // map_get_hashed() arguments
+    uint8_t  coded[micro_symbols * 2];
+    uint8_t  decoded[micro_symbols];
+    uint64_t freq[256];
+    uint64_t tree[256];
+    size_t   bytes;                  // range coded bytes
+    struct map_entry entry[micro_entries];
+    uint64_t sink;                   // keeps results alive
+};
+
+static struct micro micro;
+
+static uint64_t micro_random(uint64_t* state) { // splitmix64
+    uint64_t z = (*state += 0x9E3779B97F4A7C15uLL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9uLL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBuLL;
+    return z ^ (z >> 31);
+}
+
+static double micro_uniform01(uint64_t* state) { // (0..1]
+    return ((micro_random(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static void micro_generate(int32_t distribution) {
+    uint64_t state = 0x5A5A5A5A5A5A5A5AuLL + (uint64_t)distribution;
+    double cdf[256]; // Zipf s = 1
+    double total = 0;
+    for (int32_t i = 0; i < 256; i++) { total += 1.0 / (i + 1); cdf[i] = total; }
+    for (size_t i = 0; i < micro_symbols; i++) {
+        uint32_t s = 0;
+        if (distribution == micro_uniform) {
+            s = (uint32_t)(micro_random(&state) >> 56);
+        } else if (distribution == micro_geometric) { // p(k) = q^k (1 - q)
+            const double k = log(micro_uniform01(&state)) / log(0.75);
+            s = k < 255 ? (uint32_t)k : 255;
+        } else {
+            const double u = micro_uniform01(&state) * total;
+            uint32_t lo = 0;
+            uint32_t hi = 255;
+            while (lo < hi) {
+                const uint32_t m = (lo + hi) / 2;
+                if (cdf[m] < u) { lo = m + 1; } else { hi = m; }
+            }
+            s = lo;
+        }
+        micro.sym[i] = (uint8_t)s;
+    }
+}
+
+static double micro_entropy(void) { // bits per symbol of the sequence
+    uint64_t count[256] = {0};
+    for (size_t i = 0; i < micro_symbols; i++) { count[micro.sym[i]]++; }
+    double e = 0;
+    for (int32_t i = 0; i < 256; i++) {
+        if (count[i] > 0) {
+            const double p = (double)count[i] / micro_symbols;
+            e -= p * log2(p);
+        }
+    }
+    return e;
+}
+
+static void micro_model(struct prob_model* pm) {
+    pm->freq = micro.freq;
+    pm->tree = micro.tree;
+    pm->n    = 256;
+    pm->id   = sqz_model_byte;
+    pm_init(pm, 256);
+}
+
+static void micro_ft_update(struct sqz* s) {
+    (void)s;
+    for (size_t i = 0; i < micro_symbols; i++) {
+        ft_update(micro.tree, 256, micro.sym[i], 1);
+    }
+}
+
+static void micro_ft_query(struct sqz* s) {
+    (void)s;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < micro_symbols; i++) {
+        sum += ft_query(micro.tree, 256, micro.sym[i]);
+    }
+    micro.sink += sum;
+}
+
+static void micro_ft_index_of(struct sqz* s) {
+    (void)s;
+    int32_t sum = 0;
+    for (size_t i = 0; i < micro_symbols; i++) {
+        sum += ft_index_of(micro.tree, 256, micro.sum[i]);
+    }
+    micro.sink += (uint64_t)sum;
+}
+
+static void micro_pm_update(struct sqz* s) {
+    (void)s;
+    struct prob_model pm;
+    micro_model(&pm);
+    for (size_t i = 0; i < micro_symbols; i++) {
+        pm_update(&pm, micro.sym[i], 1);
+    }
+}
+
+static void micro_rc_encode(struct sqz* s) {
+    (void)s;
+    struct prob_model pm;
+    micro_model(&pm);
+    struct rc_memory m;
+    rc_memory_init(&m, micro.coded, sizeof(micro.coded));
+    for (size_t i = 0; i < micro_symbols; i++) {
+        rc_encode(&m.rc, &pm, micro.sym[i]);
+    }
+    rc_flush(&m.rc);
+    swear(m.rc.error == 0);
+    micro.bytes = m.bytes;
+}
+
+static void micro_rc_decode(struct sqz* s) {
+    (void)s;
+    struct prob_model pm;
+    micro_model(&pm);
+    struct rc_memory m;
+    rc_memory_init(&m, micro.coded, micro.bytes);
+    rc_prefetch(&m.rc);
+    for (size_t i = 0; i < micro_symbols; i++) {
+        micro.decoded[i] = rc_decode(&m.rc, &pm);
+    }
+    swear(m.rc.error == 0);
+}
+
+static void micro_map_put(struct sqz* s) {
+    map_clear(&s->map);
+    for (size_t i = 0; i + micro_key <= micro_symbols; i++) {
+        map_put(s, micro.sym + i, micro_key);
+    }
+}
+
+static void micro_map_get_hashed(struct sqz* s) {
+    int32_t sum = 0;
+    for (size_t i = 0; i + micro_key <= micro_symbols; i++) {
+        sum += map_get_hashed(&s->map, micro.hash[i], micro.sym + i,
+                              micro_key);
+    }
+    micro.sink += (uint64_t)sum;
+}
+
+static void micro_map_best(struct sqz* s) {
+    map_clear(&s->map);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < micro_symbols; i++) {
+        uint32_t distance = 0;
+        uint8_t  size = 0;
+        const size_t bytes = micro_symbols - i;
+        map_best(s, micro.sym + i, bytes < sqz_max_len ? bytes : sqz_max_len,
+                 &distance, &size, micro_window);
+        if (size == 0 && bytes >= micro_key) {
+            map_put(s, micro.sym + i, micro_key);
+        }
+        sum += size;
+    }
+    micro.sink += sum;
+}
+
+static double micro_time(void (*f)(struct sqz* s), struct sqz* s,
+                         void (*prepare)(struct sqz* s)) {
+    double ns[micro_runs];
+    for (int32_t r = 0; r < micro_runs; r++) {
+        if (prepare != null) { prepare(s); }
+        const uint64_t start = sqz_trace_time();
+        f(s);
+        ns[r] = (double)(sqz_trace_time() - start) / micro_symbols;
+    }
+    for (int32_t i = 1; i < micro_runs; i++) { // insertion sort
+        const double v = ns[i];
+        int32_t j = i - 1;
+        while (j >= 0 && ns[j] > v) { ns[j + 1] = ns[j]; j--; }
+        ns[j + 1] = v;
+    }
+    return ns[micro_runs / 2];
+}
+
+static void micro_prepare_tree(struct sqz* s) { // trained on the sequence
+    (void)s;
+    struct prob_model pm;
+    micro_model(&pm);
+    for (size_t i = 0; i < micro_symbols; i++) {
+        pm_update(&pm, micro.sym[i], 1);
+    }
+    for (size_t i = 0; i < micro_symbols; i++) {
+        const uint8_t sym = micro.sym[i];
+        micro.sum[i] = ft_query(micro.tree, 256, (int32_t)sym - 1) +
+                       micro.freq[sym] / 2;
+    }
+}
+
+static void micro_prepare_map(struct sqz* s) {
+    micro_map_put(s);
+    for (size_t i = 0; i + micro_key <= micro_symbols; i++) {
+        micro.hash[i] = map_hash64(micro.sym + i, micro_key);
+    }
+}
+
+static void micro_verify(struct sqz* s) {
+    micro_prepare_tree(s);
+    for (size_t i = 0; i < micro_symbols; i++) {
+        // pm_index_of() is ft_index_of() + 1:
+        swear(ft_index_of(micro.tree, 256, micro.sum[i]) + 1 == micro.sym[i]);
+    }
+    micro_rc_encode(s);
+    micro_rc_decode(s);
+    swear(memcmp(micro.sym, micro.decoded, micro_symbols) == 0);
+}
+
+struct micro_bench {
+    const char* name;
+    void (*run)(struct sqz* s);
+    void (*prepare)(struct sqz* s);
+};
+
+static const struct micro_bench micro_bench[] = {
+    { "ft_update",      micro_ft_update,      micro_prepare_tree },
+    { "ft_query",       micro_ft_query,       micro_prepare_tree },
+    { "ft_index_of",    micro_ft_index_of,    micro_prepare_tree },
+    { "pm_update",      micro_pm_update,      null },
+    { "rc_encode",      micro_rc_encode,      null },
+    { "rc_decode",      micro_rc_decode,      null },
+    { "map_put",        micro_map_put,        null },
+    { "map_get_hashed", micro_map_get_hashed, micro_prepare_map },
+    { "map_best",       micro_map_best,       null },
+};
+
+int main(int argc, const char* argv[]) {
+    (void)argc; (void)argv; // unused
+    struct sqz_params p;
+    sqz_params_init(&p);
+    p.level = 0; // map only, no hash chain
+    const size_t size = sqz_sizeof(&p);
+    void* memory = malloc(size);
+    if (memory == null) { return ENOMEM; }
+    struct sqz* s = sqz_init_with(memory, size, &p);
+    swear(s != null);
+    map_init(s, micro.entry, micro_entries);
+    double ns[countof(micro_bench)][micro_distributions];
+    double entropy[micro_distributions];
+    double bps[micro_distributions]; // range coded bits per symbol
+    for (int32_t d = 0; d < micro_distributions; d++) {
+        micro_generate(d);
+        entropy[d] = micro_entropy();
+        micro_verify(s);
+        bps[d] = micro.bytes * 8.0 / micro_symbols;
+        for (int32_t b = 0; b < countof(micro_bench); b++) {
+            ns[b][d] = micro_time(micro_bench[b].run, s,
+                                  micro_bench[b].prepare);
+        }
+    }
+    printf("ns/symbol       %10s %10s %10s\n",
+           micro_name[0], micro_name[1], micro_name[2]);
+    for (int32_t b = 0; b < countof(micro_bench); b++) {
+        printf("%-15s %10.2f %10.2f %10.2f\n", micro_bench[b].name,
+               ns[b][0], ns[b][1], ns[b][2]);
+    }
+    printf("entropy         %10.3f %10.3f %10.3f bits/symbol\n",
+           entropy[0], entropy[1], entropy[2]);
+    printf("range coded     %10.3f %10.3f %10.3f bits/symbol\n",
+           bps[0], bps[1], bps[2]);
+    printf("(sink: %llu)\n", micro.sink);
+    free(memory);
+    return 0;
+}
@@ -2,6 +2,7 @@
 #include "shl/sqz/sqz.h"
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 struct {
@@ -26,32 +27,40 @@ static errno_t lorem_ipsum(void) {
                        "Lorem ipsum dolor sit amet. ";
     size_t input_size = strlen(text);
     uint64_t compressed_size = 0;
+    struct sqz_params params;
+    sqz_params_init(&params);
+    params.window_bits = 11; // 2KB
+    params.block_bits  = 10; // small input
+    const size_t size = sqz_sizeof(&params);
+    void* memory = malloc(size);
+    if (memory == null) { return ENOMEM; }
     {
-        static struct sqz compress;
-        compress.that = 0;
+        struct sqz* compress = sqz_init_with(memory, size, &params);
         assert(sizeof(io.data) > input_size * 2);
-        sqz_init(&compress, null, 0);
-        compress.rc.write = put;
-        // window_bits: 11 (2KB)
-        sqz_compress(&compress, text, input_size, 1u << 11);
-        if (compress.rc.error != 0) {
-            printf("Compression error: %d\n", compress.rc.error);
-            return compress.rc.error;
+        compress->rc.write = put;
+        sqz_compress(compress, text, input_size, 1u << params.window_bits);
+        const errno_t r = compress->rc.error;
+        if (r != 0) {
+            printf("Compression error: %d\n", r);
+            free(memory);
+            return r;
         }
         compressed_size = io.written;
         printf("%d into %d bytes\n", (int)input_size, (int)compressed_size);
     }
     {
         static char decompressed_data[1024];
-        static struct sqz decompress;
+        // the same memory is reused for decompression context:
+        struct sqz* decompress = sqz_init_with(memory, size, &params);
         assert(sizeof(decompressed_data) > input_size);
-        sqz_init(&decompress, null, 0);
-        decompress.rc.read = get;
-        uint64_t decompressed = sqz_decompress(&decompress, decompressed_data,
+        decompress->rc.read = get;
+        uint64_t decompressed = sqz_decompress(decompress, decompressed_data,
                                                input_size);
-        if (decompress.rc.error != 0) {
-            printf("Decompression error: %d\n", decompress.rc.error);
-            return decompress.rc.error;
+        const errno_t r = decompress->rc.error;
+        free(memory);
+        if (r != 0) {
+            printf("Decompression error: %d\n", r);
+            return r;
         } else {
             if (decompressed != strlen(text)) {
                 printf("Decompressed size does not match original size\n");
@@ -13,9 +13,14 @@
 #include <assert.h>
 #endif
 #include <math.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #define UNSTD_NO_RT_IMPLEMENTATION // TODO: remove
 #include "rt/ustd.h"               // TODO: remove
@@ -36,6 +41,48 @@ static void    map_best(struct sqz* s, const void* data, size_t bytes,
                         uint32_t* distance, uint8_t* size, uint32_t window);
 static void    map_remove(struct map* m, int32_t i);
 static void    map_clear(struct map *m);
+static bool    sqz_params_valid(const struct sqz_params* p);
+
+// sqz_count() adds to sqz_counters of a range coder, sqz_clock() and
+// sqz_timed() accumulate ticks spent in a stage since sqz_clock().
+
+#ifdef SQZ_INSTRUMENT
+
+static inline uint64_t sqz_ticks(void) {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    return __rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000uLL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#define sqz_count(rc, field, n) do {                                    \
+    if ((rc)->counters != null) { (rc)->counters->field += (n); }       \
+} while (0)
+
+#define sqz_clock(rc) ((rc)->counters != null ? sqz_ticks() : 0)
+
+#define sqz_timed(rc, stage, t0) do {                                   \
+    if ((rc)->counters != null) {                                       \
+        (rc)->counters->ticks[stage] += sqz_ticks() - (t0);             \
+    }                                                                   \
+} while (0)
+
+#else
+
+#define sqz_count(rc, field, n) do { } while (0)
+#define sqz_clock(rc) 0
+#define sqz_timed(rc, stage, t0) do { (void)(t0); } while (0)
+
+#endif
 
 // map_put()  is no operation if map is filled to 75% or more
 // map_get()  returns index of matching entry or -1
@@ -72,6 +119,11 @@ static void map_init(struct sqz* s, struct map_entry entry[], size_t n) {
     m->entries = 0;
     m->max_chain = 0;
     m->max_bytes = 0;
+    m->generation = 1;
+}
+
+static inline bool map_used(const struct map* m, size_t i) {
+    return m->entry[i].generation == m->generation;
 }
 
 static int32_t map_get_hashed(const struct map* m, uint64_t hash,
@@ -79,7 +131,7 @@ static int32_t map_get_hashed(const struct map* m, uint64_t hash,
     assert(2 <= b);
     const struct map_entry* entries = m->entry;
     size_t i = (size_t)hash % m->n;
-    while (entries[i].bytes != 0) {
+    while (map_used(m, i)) {
         if (entries[i].bytes == (int32_t)b && entries[i].hash == hash &&
             memcmp(entries[i].data, d, b) == 0) {
             return (int32_t)i;
@@ -110,7 +162,7 @@ static int32_t map_put(struct sqz* s, const void* data, uint32_t b) {
         uint64_t hash = map_hash64(d, b);
         size_t i = (size_t)hash % m->n;
         uint32_t chain = 0; // max chain length
-        while (entries[i].bytes != 0) {
+        while (map_used(m, i)) {
             if (entries[i].bytes == (int32_t)b && entries[i].hash == hash &&
                 memcmp(entries[i].data, d, b) == 0) {
                 assert(d >= entries[i].data); // shorter distance
@@ -121,11 +173,13 @@ static int32_t map_put(struct sqz* s, const void* data, uint32_t b) {
             i = (i + 1) % m->n;
             assert(chain < m->n); // looping endlessly?
         }
+        sqz_count(&s->rc, map_steps, chain);
         if (chain > m->max_chain) { m->max_chain = chain; }
         if (b > m->max_bytes) { m->max_bytes = b; }
         entries[i].data = d;
         entries[i].hash = hash;
         entries[i].bytes = b;
+        entries[i].generation = m->generation;
         m->entries++;
         return (int32_t)i;
     }
@@ -145,6 +199,7 @@ static void map_best(struct sqz* s, const void* data, size_t bytes,
         hash = map_hash64_byte(hash, d[1]);
         for (uint8_t i = 2; i < b - 1; i++) {
             hash = map_hash64_byte(hash, d[i]);
+            sqz_count(&s->rc, map_probes, 1);
             int32_t r = map_get_hashed(m, hash, data, i + 1);
             if (r != -1 && d - m->entry[r].data >= max_distance) {
                 map_remove(m, r);
@@ -172,19 +227,133 @@ static void map_best(struct sqz* s, const void* data, size_t bytes,
         *size = (uint8_t)ex;
         if (ex != b) {
             assert(memcmp(m->entry[best].data, d, ex) == 0);
-            printf("[%d] best_bytes: %d extended to: %d\n", best, b, ex);
             map_put(s, d, ex);
         }
     }
 }
 
 static void map_clear(struct map *m) {
-    memset(m->entry, 0, m->n * sizeof(m->entry[0]));
+    // entries of other generations are empty, memset() once in 2^32 clears
+    if (++m->generation == 0) {
+        memset(m->entry, 0, m->n * sizeof(m->entry[0]));
+        m->generation = 1;
+    }
     m->entries = 0;
     m->max_chain = 0;
     m->max_bytes = 0;
 }
 
+// Hash chain of all positions inside the window keyed by 3 bytes prefix.
+// chain_best() walks at most depth candidates.
+// Positions are stored offset by base that chain_reset() moves past all
+// positions of previous streams, so their entries are older than any
+// position of the current stream and chain_best() stops at them.
+
+static inline uint32_t chain_hash(const struct chain* c, const uint8_t* d) {
+    const uint32_t v = (uint32_t)d[0] | ((uint32_t)d[1] << 8) |
+                      ((uint32_t)d[2] << 16);
+    return (v * 2654435761u) >> (32 - c->bits);
+}
+
+static void chain_init(struct chain* c) {
+    if (c->head != null) {
+        memset(c->head, 0, sizeof(c->head[0]) << c->bits);
+    }
+    c->base = 0;
+    c->end  = 0;
+}
+
+static void chain_start(struct chain* c, size_t bytes) {
+    if (bytes >= (size_t)(UINT32_MAX - c->base)) { chain_init(c); }
+    const uint32_t end = bytes < UINT32_MAX - c->base ?
+                         c->base + (uint32_t)bytes : UINT32_MAX;
+    if (end > c->end) { c->end = end; }
+}
+
+static void chain_reset(struct chain* c) {
+    c->base = c->end;
+}
+
+static inline void chain_insert(struct chain* c, const uint8_t* d,
+                                size_t i, size_t bytes) {
+    if (i + 2 < bytes) {
+        const uint32_t h = chain_hash(c, d + i);
+        const uint32_t e = c->base + (uint32_t)(i + 1);
+        c->prev[(e - 1) & (c->window - 1)] = c->head[h];
+        c->head[h] = e;
+    }
+}
+
+static inline uint32_t sqz_match_len(const uint8_t* d, size_t i,
+                                     size_t bytes, size_t dist) {
+    const uint8_t* p = d + i - dist;
+    const uint8_t* s = d + i;
+    const size_t n = bytes - i < sqz_max_len ? bytes - i : sqz_max_len;
+    size_t k = 0;
+    while (k < n && p[k] == s[k]) { k++; }
+    return (uint32_t)k;
+}
+
+static uint32_t chain_best(struct chain* c, const uint8_t* d, size_t i,
+                           size_t bytes, uint32_t window, uint32_t depth,
+                           uint32_t* distance, uint8_t* size) {
+    // returns number of compared candidates
+    *size = 0;
+    *distance = 0;
+    uint32_t steps = 0;
+    if (i + 2 < bytes) {
+        const uint32_t limit = window < c->window ? window : c->window;
+        const uint32_t cur = c->base + (uint32_t)(i + 1);
+        uint32_t e = c->head[chain_hash(c, d + i)];
+        uint32_t last = 0; // distances must strictly increase
+        for (uint32_t k = 0; k < depth && e != 0; k++) {
+            const uint32_t dist = cur - e; // modulo 2^32
+            if (dist <= last || dist >= limit || dist > i) { break; }
+            const uint32_t n = sqz_match_len(d, i, bytes, dist);
+            steps++;
+            if (n > *size) {
+                *size = (uint8_t)n;
+                *distance = dist;
+                if (n == sqz_max_len) { break; }
+            }
+            last = dist;
+            e = c->prev[(e - 1) & (c->window - 1)];
+        }
+    }
+    return steps;
+}
+
+// Long runs of the same byte (zero padding, sparse files, flat image
+// areas) are coded as chained distance 1 matches without querying the
+// match finders. Inside the run all positions hash alike and would only
+// lengthen chains, so they are not inserted.
+
+enum { sqz_min_run = 32 };
+
+static inline size_t sqz_run_length(const uint8_t* d, size_t i, size_t end) {
+    // number of bytes d[i..end) equal to d[i - 1], compared 8 at a time
+    const uint64_t v = d[i - 1] * 0x0101010101010101uLL;
+    size_t k = i;
+    while (k + sizeof(v) <= end) {
+        uint64_t w;
+        memcpy(&w, d + k, sizeof(w));
+        if (w != v) { break; }
+        k += sizeof(w);
+    }
+    while (k < end && d[k] == d[i - 1]) { k++; }
+    return k - i;
+}
+
+// rep[] is move-to-front cache of the most recently used distances.
+// rep_index: 0 new distance, 1..4 reuse of rep[rep_index - 1].
+
+static inline void sqz_rep_update(uint32_t rep[4], uint8_t rep_index,
+                                  uint32_t dist) {
+    int k = rep_index == 0 ? 3 : rep_index - 1;
+    while (k > 0) { rep[k] = rep[k - 1]; k--; }
+    rep[0] = dist;
+}
+
 #if 0
 static void pretty_print(struct tree_node* node, size_t indent) {
     if (!node) return;
@@ -399,17 +568,6 @@ static inline int32_t ft_lsb(int32_t i) { // least significant bit only
     return i & (~i + 1); // (i & -i)
 }
 
-static void ft_init(uint64_t tree[], size_t n, uint64_t a[]) {
-    const int32_t m = (int32_t)n;
-    for (int32_t i = 0; i <  m; i++) { tree[i] = a[i]; }
-    for (int32_t i = 1; i <= m; i++) {
-        int32_t parent = i + ft_lsb(i);
-        if (parent <= m) {
-            tree[parent - 1] += tree[i - 1];
-        }
-    }
-}
-
 static void ft_update(uint64_t tree[], size_t n, int32_t i, uint64_t inc) {
     while (i < (int32_t)n) {
         tree[i] += inc;
@@ -444,35 +602,56 @@ static int32_t ft_index_of(uint64_t tree[], size_t n, uint64_t const sum) {
     return i == 0 && value < sum ? -1 : (int32_t)(i - 1);
 }
 
+// Models have power of 2 number of entries pm->n, so that the last
+// entry of the Fenwick tree is the total frequency.
+
 static inline uint64_t pm_sum_of(struct prob_model* pm, uint32_t sym) {
-    return ft_query(pm->tree, countof(pm->tree), sym - 1);
+    return ft_query(pm->tree, pm->n, sym - 1);
 }
 
 static inline uint64_t pm_total_freq(struct prob_model* pm) {
-    return pm->tree[countof(pm->tree) - 1];
+    return pm->tree[pm->n - 1];
 }
 
 static inline int32_t pm_index_of(struct prob_model* pm, uint64_t sum) {
-    return ft_index_of(pm->tree, countof(pm->tree), sum) + 1;
+    return ft_index_of(pm->tree, pm->n, sum) + 1;
 }
 
 void pm_init(struct prob_model* pm, uint32_t n) {
-    for (size_t i = 0; i < countof(pm->freq); i++) {
-        pm->freq[i] = i < n ? 1 : 0;
+    // Fenwick tree of freq[0..n) = 1 in one pass: tree[i - 1] is the number
+    // of symbols < n in (i - ft_lsb(i)..i]
+    for (uint32_t i = 1; i <= pm->n; i++) {
+        const uint32_t lo = i - (uint32_t)ft_lsb((int32_t)i);
+        pm->freq[i - 1] = i <= n ? 1 : 0;
+        pm->tree[i - 1] = (i < n ? i : n) - (lo < n ? lo : n);
     }
-    ft_init(pm->tree, countof(pm->tree), pm->freq);
 }
 
 void pm_update(struct prob_model* pm, uint8_t sym, uint64_t inc) {
     const uint64_t pm_max_freq = (1uLL << (64 - 8));
-    if (pm->tree[countof(pm->tree) - 1] < pm_max_freq) {
+    if (pm->tree[pm->n - 1] < pm_max_freq) {
         pm->freq[sym] += inc;
-        ft_update(pm->tree, countof(pm->tree), sym, inc);
+        ft_update(pm->tree, pm->n, sym, inc);
     }
 }
 
+static void rc_memory_write(struct range_coder* rc, uint8_t b);
+static uint8_t rc_memory_read(struct range_coder* rc);
+
+// rc_memory coders write block sub-streams to memory, other coders
+// write through sqz.rc callbacks:
+#define sqz_count_written(rc) do {                                      \
+    if ((rc)->write != rc_memory_write) { sqz_count(rc, written, 1); }  \
+} while (0)
+
+#define sqz_count_read(rc) do {                                         \
+    if ((rc)->read != rc_memory_read) { sqz_count(rc, read, 1); }       \
+} while (0)
+
 static void rc_emit(struct range_coder* rc) {
     const uint8_t byte = (uint8_t)(rc->low >> 56);
+    sqz_count(rc, emits, 1);
+    sqz_count_written(rc);
     rc->write(rc, byte);
     rc->low   <<= 8;
     rc->range <<= 8;
@@ -497,27 +676,37 @@ static void rc_flush(struct range_coder* rc) {
 }
 
 static void rc_consume(struct range_coder* rc) {
+    sqz_count(rc, consumes, 1);
+    sqz_count_read(rc);
     const uint8_t byte   = rc->read(rc);
     rc->code    = (rc->code << 8) + byte;
     rc->low   <<= 8;
     rc->range <<= 8;
 }
 
+static void rc_start(struct range_coder* rc) {
+    rc->low   = 0;
+    rc->range = UINT64_MAX;
+}
+
 static void rc_encode(struct range_coder* rc, struct prob_model* pm,
                uint8_t sym) {
     uint64_t total = pm_total_freq(pm);
     uint64_t start = pm_sum_of(pm, sym);
     uint64_t size  = pm->freq[sym];
+    sqz_count(rc, encodes[pm->id], 1);
+    // underflow is resolved before (not after) encoding symbol, so
+    // rc_decode() consumes exactly the same bytes at the end of a block
+    if (rc->range < total) {
+        rc_emit(rc);
+        rc_emit(rc);
+        rc->range = UINT64_MAX - rc->low;
+    }
     rc->range /= total;
     rc->low   += start * rc->range;
     rc->range *= size;
     pm_update(pm, sym, 1);
     while (rc_leftmost_byte_is_same(rc)) { rc_emit(rc); }
-    if (rc->range < total + 1) {
-        rc_emit(rc);
-        rc_emit(rc);
-        rc->range = UINT64_MAX - rc->low;
-    }
 }
 
 static uint8_t rc_err(struct range_coder* rc, int32_t e) {
@@ -528,6 +717,7 @@ static uint8_t rc_err(struct range_coder* rc, int32_t e) {
 static uint8_t rc_decode(struct range_coder* rc, struct prob_model* pm) {
     uint64_t total = pm_total_freq(pm);
     if (total < 1) { return rc_err(rc, EINVAL); }
+    sqz_count(rc, decodes[pm->id], 1);
     if (rc->range < total) {
         rc_consume(rc);
         rc_consume(rc);
@@ -547,293 +737,2489 @@ static uint8_t rc_decode(struct range_coder* rc, struct prob_model* pm) {
     return (uint8_t)sym;
 }
 
-void sqz_init(struct sqz* s, struct map_entry entry[], size_t n) {
-    rc_init(&s->rc, 0);
-    pm_init(&s->pm_literal, 2);
+static void sqz_init_models(struct sqz* s) {
+    pm_init(&s->pm_run, 256);
     pm_init(&s->pm_size, 256);
-    pm_init(&s->pm_byte, 256);
+    for (size_t c = 0; c < countof(s->pm_byte); c++) {
+        pm_init(&s->pm_byte[c], 256);
+    }
     pm_init(&s->pm_bits, 32);
     for (size_t b = 0; b < countof(s->pm_dist); b++) {
         pm_init(&s->pm_dist[b], 2);
     }
+    pm_init(&s->pm_rep, countof(s->rep) + 1);
+}
+
+void sqz_init(struct sqz* s, struct map_entry entry[], size_t n) {
+    rc_init(&s->rc, 0);
+    sqz_init_models(s);
+    for (uint32_t r = 0; r < countof(s->rep); r++) { s->rep[r] = r + 1; }
+    memcpy(s->block.rep_start, s->rep, sizeof(s->rep));
+    chain_init(&s->chain);
+    s->backend = sqz_range;
+    s->level = sqz_default_level;
     if (entry != null) {
         map_init(s, entry, n);
     } else {
         memset(&s->map, 0, sizeof(s->map));
     }
-//  tree_init(&s->tree);
 }
 
-#define SQUEEZE_MAP_STATS
+void sqz_reset(struct sqz* s) {
+    rc_init(&s->rc, 0);
+    sqz_init_models(s);
+    for (uint32_t r = 0; r < countof(s->rep); r++) { s->rep[r] = r + 1; }
+    memcpy(s->block.rep_start, s->rep, sizeof(s->rep));
+    chain_reset(&s->chain);
+    if (s->map.entry != null) { map_clear(&s->map); }
+}
 
-#ifdef SQUEEZE_MAP_STATS
+// Context memory: struct sqz is followed by models, match finder and
+// block arrays sized for the parameters. Decoder only contexts can be
+// made with level 0 that has no match finder memory.
 
-static double sqz_entropy(uint64_t* freq, size_t n) { // Shannon entropy
-    double total = 0;
-    for (size_t i = 0; i < n; i++) {
-        if (freq[i] > 1) {
-            total += (double)freq[i];
-        }
+static void* sqz_carve(uint8_t* m, size_t* at, size_t bytes) {
+    // m == null only measures
+    void* a = m != null ? m + *at : null;
+    *at += (bytes + 7) & ~(size_t)7;
+    return a;
+}
+
+static void sqz_carve_model(uint8_t* m, size_t* at, struct prob_model* pm,
+                            uint32_t n, uint32_t id) {
+    pm->n = n;
+    pm->id = id;
+    pm->freq = (uint64_t*)sqz_carve(m, at, n * sizeof(pm->freq[0]));
+    pm->tree = (uint64_t*)sqz_carve(m, at, n * sizeof(pm->tree[0]));
+}
+
+static size_t sqz_layout(struct sqz* s, uint8_t* m, const struct sqz_params* p,
+                         struct sqz_memory_usage* u) { // null or parts
+    size_t at = (sizeof(struct sqz) + 7) & ~(size_t)7;
+    if (u != null) { u->head = at; }
+    sqz_carve_model(m, &at, &s->pm_run, 256, sqz_model_run);
+    sqz_carve_model(m, &at, &s->pm_size, 256, sqz_model_size);
+    for (size_t c = 0; c < countof(s->pm_byte); c++) {
+        sqz_carve_model(m, &at, &s->pm_byte[c], 256, sqz_model_byte);
     }
-    double e = 0.0;
-    for (size_t i = 0; i < n; i++) {
-        if (freq[i] > 1) {
-            double p_i = (double)freq[i] / total;
-            e -= p_i * log2(p_i);
-        }
+    sqz_carve_model(m, &at, &s->pm_bits, 32, sqz_model_bits);
+    for (size_t b = 0; b < countof(s->pm_dist); b++) {
+        sqz_carve_model(m, &at, &s->pm_dist[b], 2, sqz_model_dist);
+    }
+    // countof(s->rep) + 1:
+    sqz_carve_model(m, &at, &s->pm_rep, 8, sqz_model_rep);
+    if (u != null) { u->models = at - u->head; }
+    struct chain* c = &s->chain;
+    if (p->level != 0) {
+        c->bits   = (uint32_t)p->window_bits;
+        c->window = 1u << p->window_bits;
+        c->head = (uint32_t*)sqz_carve(m, &at, sizeof(c->head[0]) << c->bits);
+        c->prev = (uint32_t*)sqz_carve(m, &at, sizeof(c->prev[0]) * c->window);
+    } else {
+        c->bits   = 0;
+        c->window = 0;
+        c->head = null;
+        c->prev = null;
     }
-    return e;
+    if (u != null) { u->chain = at - u->head - u->models; }
+    struct sqz_block* b = &s->block;
+    b->capacity = p->block_bits < sqz_max_block_bits ?
+                  1u << p->block_bits : sqz_max_block;
+    b->run  = (uint8_t*)sqz_carve(m, &at, b->capacity);
+    b->byte = (uint8_t*)sqz_carve(m, &at, b->capacity);
+    b->size = (uint8_t*)sqz_carve(m, &at, b->capacity / 2);
+    b->rep  = (uint8_t*)sqz_carve(m, &at, b->capacity / 2);
+    b->bits = (uint8_t*)sqz_carve(m, &at, b->capacity / 2);
+    b->dist = (uint32_t*)sqz_carve(m, &at, b->capacity / 2 * sizeof(b->dist[0]));
+    b->data = (uint8_t*)sqz_carve(m, &at, b->capacity);
+    if (u != null) { u->block = at - u->head - u->models - u->chain; }
+    return at;
 }
 
-#endif
+size_t sqz_sizeof(const struct sqz_params* p) {
+    struct sqz s;
+    return sqz_params_valid(p) ? sqz_layout(&s, null, p, null) : 0;
+}
 
-void sqz_compress(struct sqz* s, const void* memory, size_t bytes, uint32_t window) {
-s->map.n = 0;
-    static_assert(sizeof(size_t) == 4 || sizeof(size_t) == 8, "32|64 only");
-    if (bytes > (uint64_t)INT32_MAX && sizeof(size_t) == 4) {
-        s->rc.error = E2BIG;
-        return;
+struct sqz* sqz_init_with(void* memory, size_t size,
+                          const struct sqz_params* p) {
+    struct sqz* s = null;
+    if (memory != null && ((uintptr_t)memory & 7) == 0 &&
+        sqz_params_valid(p) && size >= sqz_sizeof(p)) {
+        s = (struct sqz*)memory;
+        memset(s, 0, sizeof(*s));
+        sqz_layout(s, (uint8_t*)memory, p, null);
+        sqz_init(s, null, 0);
+        if (p->backend != sqz_auto) { s->backend = p->backend; }
+        if (p->level   != sqz_auto) { s->level   = p->level; }
     }
-    const uint8_t* d = (const uint8_t*)memory;
-    size_t i = 0;
-    #ifdef SQUEEZE_MAP_STATS
-        static double   map_distance_sum;
-        static double   map_len_sum;
-        static uint64_t map_count;
-        map_distance_sum = 0;
-        map_len_sum = 0;
-        map_count = 0;
-        size_t br_bytes   = 0; // source bytes encoded as back references
-        size_t li_bytes   = 0; // source bytes encoded "as is" literals
-        size_t rejections = 0; // count of rejected back references
-        static size_t size_histogram[256];
-        static size_t distance_bits_histogram[32];
-        memset(distance_bits_histogram, 0, sizeof(distance_bits_histogram));
-        memset(size_histogram, 0, sizeof(size_histogram));
-    #endif
-    while (i < bytes && s->rc.error == 0) {
-//      const size_t maximum = bytes - i < sqz_max_len ? bytes - i : sqz_max_len;
-        uint8_t  map_size = 0;
-        uint32_t map_dist = 0;
-        if (s->map.n > 0) {
-            // Use map_best() before O(n) LZ search
-            map_best(s, d + i, bytes - i, &map_dist, &map_size, window);
-            if (map_size >= sqz_min_len) {
-                #ifdef SQUEEZE_MAP_STATS
-                    map_distance_sum += map_dist;
-                    map_len_sum += map_size;
-                    map_count++;
-                #endif
-            }
-        }
+    return s;
+}
 
-#undef  SQZ_NO_COMPARE_TO_LZ77
-#define SQZ_NO_COMPARE_TO_LZ77
+int32_t sqz_memory_usage(const struct sqz_params* p, int32_t kind,
+                         size_t map_entries,
+                         struct sqz_memory_usage* u) {
+    memset(u, 0, sizeof(*u));
+    if (!sqz_params_valid(p) || map_entries > UINT32_MAX ||
+        (kind != sqz_pool_encoder && kind != sqz_pool_decoder)) {
+        return EINVAL;
+    }
+    struct sqz_params params = *p;
+    if (kind == sqz_pool_decoder) {
+        params.level = 0;
+        map_entries = 0;
+    }
+    struct sqz s;
+    const size_t bytes = sqz_layout(&s, null, &params, u);
+    u->map = map_entries * sizeof(struct map_entry);
+    u->total = bytes + u->map;
+    assert(bytes == u->head + u->models + u->chain + u->block);
+    return 0;
+}
 
-#ifndef SQZ_NO_COMPARE_TO_LZ77
-        uint8_t  lz77_size = map_size;
-        uint32_t lz77_dist = map_dist;
-        // Perform O(n) LZ search only if map_best() didn't find a match
-        if (map_size < sqz_min_len && i >= 1) {
-            size_t j = i - 1;
-            size_t min_j = i >= window ? i - window + 1 : 0;
-            for (;;) {
-                const size_t n = bytes - i;
-                size_t k = 0;
-                while (k < n && d[j + k] == d[i + k] && k < sqz_max_len) {
-                    k++;
-                }
-                if (k >= sqz_min_len && k > lz77_size) {
-                    lz77_size = (uint8_t)k;
-                    lz77_dist = (uint32_t)(i - j);
-                    if (lz77_size == sqz_max_len) break;
-                }
-                if (j == min_j) break;
-                j--;
-            }
-        }
+// Pool: encoders are followed by decoders, each context is aligned to
+// a cache line so that threads do not share lines of working memory.
+// Free stacks are linked through next[] by global index (decoders are
+// n..2n - 1). The top of a stack is tagged by a counter incremented on
+// every change, so a pop that raced with pop and push of the same
+// context (ABA) fails its compare and swap instead of corrupting it.
+
+#ifdef _MSC_VER
+#define sqz_thread_local __declspec(thread)
+#else
+#define sqz_thread_local _Thread_local
 #endif
-        assert(sqz_max_len < window);
-        size_t best_dist = 0;
-        size_t best_size = 0;
-//      tree_find_recursive_debug = i == 69;
-//      tree_find(&s->tree, d + i, maximum, &best_size, &best_dist);
-#ifndef SQZ_NO_COMPARE_TO_LZ77
-        if (lz77_size >= sqz_min_len || best_size >= sqz_min_len) {
-            if (lz77_size != best_size || lz77_dist != best_dist) {
-                const uint8_t* match0 = d + i - best_dist;
-                printf("[%zu] %5u:%3d tree `%.*s`\n", i, best_dist, best_size, (int)best_size, match0);
-                swear(memcmp(match0, d + i, best_size) == 0);
-                const uint8_t* match1 = d + i - lz77_dist;
-                printf("[%zu] %5u:%3d lz77 `%.*s\n`", i, lz77_dist, lz77_size, (int)lz77_size, match1);
-                swear(memcmp(match1, d + i, lz77_size) == 0);
-                printf("[%zu] %5u:%3u tree %5u:%3u lz77\n", i,
-                       best_dist, best_size, lz77_dist, lz77_size);
-                pretty_print(s->tree.root, 0);
-                swear(lz77_size == best_size && lz77_dist == best_dist);
-            }
-        }
+
+static inline uint64_t sqz_atomic_load64(uint64_t* a) {
+#ifdef _MSC_VER
+    return (uint64_t)_InterlockedCompareExchange64((volatile long long*)a,
+                                                   0, 0);
+#else
+    return __atomic_load_n(a, __ATOMIC_ACQUIRE);
 #endif
-        // reject back references that take too much compressed space:
-        uint8_t bits = sqz_bits_of((uint32_t)best_dist);
-        if (best_size <= 3 && bits > 3) {
-            best_size = 0;
-            best_dist = 0;
-            #ifdef SQUEEZE_MAP_STATS
-            rejections++;
-            #endif
-        }
-//      printf("[%zu] insert('%.*s' %zu)\n", i, (int)(bytes - i), d + i, i);
-        if (best_size >= sqz_min_len) {
-            rc_encode(&s->rc, &s->pm_literal, 0);
-            rc_encode(&s->rc, &s->pm_size, (uint8_t)best_size);
-            rc_encode(&s->rc, &s->pm_bits, bits);
-            #ifdef SQUEEZE_MAP_STATS
-            size_histogram[best_size]++;
-            #endif
-            uint32_t distance = (uint32_t)best_dist;
-            for (int b = 0; b < bits - 1; b++) {
-                rc_encode(&s->rc, &s->pm_dist[b], distance & 0x1);
-                distance >>= 1;
-            }
-            if (s->map.n > 0) { map_put(s, d + i, (uint32_t)best_size); }
-            size_t next = i + best_size;
-            while (i < next) {
-//              s->tree.root = tree_insert(&s->tree, s->tree.root,
-//                                         d + i, maximum, i);
-                i++;
-                if (i < bytes) {
-//                  size_t start = (i >= window) ? i - window + 1 : 0;
-//                  printf("[%u] tree_evict(start: %u)\n", i, start);
-//                  s->tree.root = tree_evict(&s->tree, s->tree.root, start);
-                }
-            }
-            #ifdef SQUEEZE_MAP_STATS
-                br_bytes += best_size;
-                if (best_dist > 0) {
-                    distance_bits_histogram[bits]++;
-                }
-            #endif
-        } else {
-            #ifdef SQUEEZE_MAP_STATS
-                li_bytes++;
-            #endif
-            // Otherwise encode literal byte
-            rc_encode(&s->rc, &s->pm_literal, 1);
-            rc_encode(&s->rc, &s->pm_byte, d[i]);
-#if 0 // makes it worse
-            if (s->map.n > 0 && i >= sqz_min_len) {
-                if (i + 1 < bytes) { map_put(s, d + i, 2); }
-                if (i + 2 < bytes) { map_put(s, d + i, 3); }
-                if (i + 3 < bytes) { map_put(s, d + i, 4); }
-            }
+}
+
+static inline bool sqz_atomic_cas64(uint64_t* a, uint64_t* expected,
+                                    uint64_t v) {
+#ifdef _MSC_VER
+    const uint64_t was = (uint64_t)_InterlockedCompareExchange64(
+        (volatile long long*)a, (long long)v, (long long)*expected);
+    const bool swapped = was == *expected;
+    *expected = was;
+    return swapped;
+#else
+    return __atomic_compare_exchange_n(a, expected, v, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
 #endif
-//          s->tree.root = tree_insert(&s->tree, s->tree.root,
-//                                     d + i, maximum, i);
-            i++;
-            if (i < bytes) {
-//              size_t start = (i >= window) ? i - window + 1 : 0;
-//              printf("[%u] tree_evict(start: %u)\n", i, start);
-//              s->tree.root = tree_evict(&s->tree, s->tree.root, start);
-            }
+}
+
+static inline uint32_t sqz_atomic_load32(uint32_t* a) {
+#ifdef _MSC_VER
+    return *(volatile uint32_t*)a;
+#else
+    return __atomic_load_n(a, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline void sqz_atomic_store32(uint32_t* a, uint32_t v) {
+#ifdef _MSC_VER
+    *(volatile uint32_t*)a = v;
+#else
+    __atomic_store_n(a, v, __ATOMIC_RELAXED);
+#endif
+}
+
+static uint64_t sqz_pool_ids; // last issued sqz_pool.id
+
+static sqz_thread_local struct sqz_pool_cache {
+    uint64_t    id;   // of the pool contexts belong to
+    struct sqz* s[2]; // [kind]
+} sqz_pool_cache;
+
+static inline size_t sqz_pool_align(size_t bytes) {
+    return (bytes + 63) & ~(size_t)63;
+}
+
+static void sqz_pool_push(struct sqz_pool* pool, int32_t kind, uint32_t i) {
+    uint64_t top = sqz_atomic_load64(&pool->top[kind]);
+    for (;;) {
+        sqz_atomic_store32(&pool->next[i], (uint32_t)top);
+        const uint64_t to = (((top >> 32) + 1) << 32) | (i + 1);
+        if (sqz_atomic_cas64(&pool->top[kind], &top, to)) { break; }
+    }
+}
+
+static uint32_t sqz_pool_pop(struct sqz_pool* pool, int32_t kind) {
+    uint64_t top = sqz_atomic_load64(&pool->top[kind]);
+    while ((uint32_t)top != 0) {
+        const uint32_t i = (uint32_t)top - 1;
+        const uint64_t to = (((top >> 32) + 1) << 32) |
+                            sqz_atomic_load32(&pool->next[i]);
+        if (sqz_atomic_cas64(&pool->top[kind], &top, to)) { return i + 1; }
+    }
+    return 0;
+}
+
+static struct sqz* sqz_pool_context(struct sqz_pool* pool, uint32_t i) {
+    const int32_t kind = i < pool->n ? sqz_pool_encoder : sqz_pool_decoder;
+    const size_t k = i - (kind == sqz_pool_encoder ? 0 : pool->n);
+    return (struct sqz*)(pool->context[kind] + k * pool->size[kind]);
+}
+
+static uint32_t sqz_pool_index(struct sqz_pool* pool, struct sqz* s,
+                               int32_t* kind) {
+    const uint8_t* c = (const uint8_t*)s;
+    *kind = c < pool->context[sqz_pool_decoder] ?
+            sqz_pool_encoder : sqz_pool_decoder;
+    const size_t k = (size_t)(c - pool->context[*kind]) / pool->size[*kind];
+    assert(k < pool->n && sqz_pool_context(pool,
+           (uint32_t)k + (*kind == sqz_pool_encoder ? 0 : pool->n)) == s);
+    return (uint32_t)k + (*kind == sqz_pool_encoder ? 0 : pool->n);
+}
+
+size_t sqz_pool_sizeof(const struct sqz_params* p, uint32_t n) {
+    struct sqz_params decoder = *p;
+    decoder.level = 0;
+    const size_t bytes = sqz_pool_align(sqz_sizeof(p)) +
+                         sqz_pool_align(sqz_sizeof(&decoder)) +
+                         2 * sizeof(uint32_t);
+    if (sqz_sizeof(p) == 0 || n == 0 || n > UINT32_MAX / 2 ||
+        n > (SIZE_MAX - 63) / bytes) {
+        return 0;
+    }
+    return 63 + n * bytes;
+}
+
+int32_t sqz_pool_init(struct sqz_pool* pool, void* memory, size_t size,
+                      const struct sqz_params* p, uint32_t n) {
+    const size_t bytes = sqz_pool_sizeof(p, n);
+    if (bytes == 0) { return EINVAL; }
+    if (memory == null || size < bytes) { return ENOBUFS; }
+    struct sqz_params decoder = *p;
+    decoder.level = 0;
+    const uintptr_t m = ((uintptr_t)memory + 63) & ~(uintptr_t)63;
+    pool->params = *p;
+    pool->n = n;
+    pool->size[sqz_pool_encoder] = sqz_pool_align(sqz_sizeof(p));
+    pool->size[sqz_pool_decoder] = sqz_pool_align(sqz_sizeof(&decoder));
+    pool->context[sqz_pool_encoder] = (uint8_t*)m;
+    pool->context[sqz_pool_decoder] = (uint8_t*)m +
+        n * pool->size[sqz_pool_encoder];
+    pool->next = (uint32_t*)(pool->context[sqz_pool_decoder] +
+                             n * pool->size[sqz_pool_decoder]);
+    pool->top[sqz_pool_encoder] = 0;
+    pool->top[sqz_pool_decoder] = 0;
+    for (uint32_t i = 2 * n; i > 0; i--) {
+        const int32_t kind = i - 1 < n ? sqz_pool_encoder : sqz_pool_decoder;
+        struct sqz* s = sqz_init_with(sqz_pool_context(pool, i - 1),
+                                      pool->size[kind],
+                                      kind == sqz_pool_encoder ? p : &decoder);
+        assert(s != null); (void)s;
+        sqz_pool_push(pool, kind, i - 1);
+    }
+    uint64_t id = sqz_atomic_load64(&sqz_pool_ids);
+    while (!sqz_atomic_cas64(&sqz_pool_ids, &id, id + 1)) { }
+    pool->id = id + 1;
+    return 0;
+}
+
+struct sqz* sqz_pool_acquire(struct sqz_pool* pool, int32_t kind) {
+    assert(kind == sqz_pool_encoder || kind == sqz_pool_decoder);
+    struct sqz_pool_cache* c = &sqz_pool_cache;
+    struct sqz* s = null;
+    if (c->id == pool->id && c->s[kind] != null) {
+        s = c->s[kind];
+        c->s[kind] = null;
+    } else {
+        uint32_t i = sqz_pool_pop(pool, kind);
+        if (i == 0 && c->id == pool->id) {
+            // contexts of the other kind cached by this thread may be
+            // what other threads are waiting for, holding on to them
+            // while all contexts are taken can starve everybody:
+            sqz_pool_flush(pool);
+            i = sqz_pool_pop(pool, kind);
         }
+        if (i != 0) { s = sqz_pool_context(pool, i - 1); }
     }
-    rc_encode(&s->rc, &s->pm_literal, 0);
-    rc_encode(&s->rc, &s->pm_size, 0xFF);
-    rc_flush(&s->rc);
-    #ifdef SQUEEZE_MAP_STATS
-        double br_percent = (100.0 * br_bytes) / (br_bytes + li_bytes);
-        double li_percent = (100.0 * li_bytes) / (br_bytes + li_bytes);
-        printf("literals: %.2f%% back references: %.2f%%\n", li_percent, br_percent);
-        printf("entropies: lit: %.2f byte: %.2f size: %.2f dist bits: %.2f",
-                sqz_entropy(s->pm_literal.freq, 256),
-                sqz_entropy(s->pm_byte.freq, 256),
-                sqz_entropy(s->pm_size.freq, 256),
-                sqz_entropy(s->pm_bits.freq, 256));
-        double h = 0;
-        for (int b = 0; b < 24; b++) {
-            double e = sqz_entropy(s->pm_dist[b].freq, 2);
-            printf(" %.2f", e);
-            h += e;
-        }
-        printf(" sum: %.2f\n", h);
-        if (map_count > 0) {
-            printf("avg dic distance: %.1f length: %.1f mapped count: %lld of %u\n",
-                    map_distance_sum / map_count,
-                    map_len_sum / map_count, map_count, s->map.n);
-            printf("map map.entries: %lld .max_bytes: %u .max_chain: %u\n",
-                    (uint64_t)s->map.entries, s->map.max_bytes, s->map.max_chain);
-        }
-        printf("rejections: %lld\n", (uint64_t)rejections);
-        double total = 0;
-        double cumulative = 0;
-        for (int j = 0; j < countof(distance_bits_histogram); j++) { total += distance_bits_histogram[j]; }
-        for (int j = 0; j < countof(distance_bits_histogram); j++) {
-            if (distance_bits_histogram[j] > 0) {
-                double p = (100.0 * distance_bits_histogram[j]) / total;
-                cumulative += p;
-                printf("distance_bits[%2d]: %7.3f%% %7.3f%%\n", j,
-                    p, cumulative);
-            }
-        }
-        total = 0;
-        cumulative = 0;
-        for (int j = 0; j < countof(size_histogram); j++) { total += size_histogram[j]; }
-        for (int j = 0; j < countof(size_histogram); j++) {
-            if (size_histogram[j] > 0) {
-                double p = (100.0 * size_histogram[j]) / total;
-                cumulative += p;
-//              printf("size[%2d]: %7.3f%% %7.3f%%\n", j,
-//                  p, cumulative);
+    return s;
+}
+
+void sqz_pool_release(struct sqz_pool* pool, struct sqz* s) {
+    int32_t kind = sqz_pool_encoder;
+    const uint32_t i = sqz_pool_index(pool, s, &kind);
+    const struct sqz_params* p = &pool->params;
+    sqz_reset(s);
+    s->stats   = null;
+    s->trace   = null;
+    s->rc.counters = null;
+    s->backend = p->backend != sqz_auto ? p->backend : sqz_range;
+    s->level   = kind == sqz_pool_decoder ? 0 :
+                 (p->level != sqz_auto ? p->level : sqz_default_level);
+    struct sqz_pool_cache* c = &sqz_pool_cache;
+    if (c->s[sqz_pool_encoder] == null && c->s[sqz_pool_decoder] == null) {
+        c->id = pool->id; // cache of another pool is empty: take it over
+    }
+    if (c->id == pool->id && c->s[kind] == null) {
+        c->s[kind] = s;
+    } else {
+        sqz_pool_push(pool, kind, i);
+    }
+}
+
+void sqz_pool_flush(struct sqz_pool* pool) {
+    struct sqz_pool_cache* c = &sqz_pool_cache;
+    if (c->id == pool->id) {
+        for (int32_t k = sqz_pool_encoder; k <= sqz_pool_decoder; k++) {
+            if (c->s[k] != null) {
+                int32_t kind = k;
+                const uint32_t i = sqz_pool_index(pool, c->s[k], &kind);
+                sqz_pool_push(pool, kind, i);
+                c->s[k] = null;
             }
         }
-    #endif
+        c->id = 0;
+    }
 }
 
-uint64_t sqz_decompress(struct sqz* s, void* data, size_t bytes) {
-    s->rc.code = 0;  // read first 8 bytes
-    for (size_t i = 0; i < sizeof(s->rc.code); i++) {
-        s->rc.code = (s->rc.code << 8) + s->rc.read(&s->rc);
+// Blocks: sqz_compress() splits input into blocks of up to
+// block.capacity <= sqz_max_block bytes. Each block starts with kind byte and uint32_t of source bytes.
+// LZ window, rep[] and adaptive models continue across blocks.
+// Stream is terminated by sqz_end kind byte.
+// sqz_stored blocks are raw source bytes. They are written for blocks
+// that look incompressible and when sqz_split block does not fit.
+
+enum { sqz_stored = 0xFE, sqz_end = 0xFF };
+
+struct sqz_memory { // sqz.that for frame blocks
+    uint8_t* data;
+    size_t   capacity;
+    size_t   bytes;
+};
+
+static void sqz_memory_write(struct range_coder* rc, uint8_t b) {
+    struct sqz_memory* m = (struct sqz_memory*)((struct sqz*)rc)->that;
+    if (m->bytes < m->capacity) {
+        m->data[m->bytes++] = b;
+    } else {
+        rc->error = E2BIG;
     }
-    uint8_t* d = (uint8_t*)data;
-    size_t i = 0;
-    while (s->rc.error == 0) {
-        uint8_t lit  = rc_decode(&s->rc, &s->pm_literal);
-        if (s->rc.error != 0) { break; }
-        if (lit) {
-            if (i < bytes) {
-                d[i++] = rc_decode(&s->rc, &s->pm_byte);
-            } else {
-                s->rc.error = ENOBUFS;
-            }
+}
+
+static uint8_t sqz_memory_read(struct range_coder* rc) {
+    struct sqz_memory* m = (struct sqz_memory*)((struct sqz*)rc)->that;
+    if (m->bytes < m->capacity) { return m->data[m->bytes++]; }
+    return rc_err(rc, EILSEQ);
+}
+
+static void sqz_write_bytes(struct sqz* s, const uint8_t* d, size_t n) {
+    if (s->rc.write == sqz_memory_write) {
+        struct sqz_memory* m = (struct sqz_memory*)s->that;
+        if (n <= m->capacity - m->bytes) {
+            memcpy(m->data + m->bytes, d, n);
+            m->bytes += n;
         } else {
-            uint8_t size = rc_decode(&s->rc, &s->pm_size);
-            if (size == 0xFF) { break; } // end of stream
-            if (size < sqz_min_len || size > sqz_max_len) {
-                s->rc.error = ERANGE;
-            } else {
-                uint8_t bits = rc_decode(&s->rc, &s->pm_bits);
-                if (s->rc.error != 0) { break; }
-                uint32_t dist = 0;
-                for (int b = 0; b < bits - 1 && s->rc.error == 0; b++) {
-                    dist |= (uint32_t)rc_decode(&s->rc, &s->pm_dist[b]) << b;
-                }
-                if (bits > 0) { dist |= (1u << bits); }
-                if (s->rc.error == 0) {
-                    const size_t n = i + size;
-                    if (i < dist) {
-                        s->rc.error = ERANGE;
-                    } else if (i >= dist && n <= bytes) {
-                        // memcpy() cannot be used on overlapped regions
-                        // because it may read more than one byte at a time.
-                        uint8_t* p = d - (size_t)dist;
-                        while (i < n) { d[i] = p[i]; i++; }
-                    } else {
-                        s->rc.error = ENOBUFS;
-                    }
-                }
-            }
+            s->rc.error = E2BIG;
+        }
+    } else {
+        for (size_t i = 0; i < n && s->rc.error == 0; i++) {
+            s->rc.write(&s->rc, d[i]);
         }
     }
-    return i;
+    sqz_count(&s->rc, written, n);
+}
+
+static void sqz_read_bytes(struct sqz* s, uint8_t* d, size_t n) {
+    if (s->rc.read == sqz_memory_read) {
+        struct sqz_memory* m = (struct sqz_memory*)s->that;
+        if (n <= m->capacity - m->bytes) {
+            memcpy(d, m->data + m->bytes, n);
+            m->bytes += n;
+        } else {
+            s->rc.error = EILSEQ;
+        }
+    } else {
+        for (size_t i = 0; i < n && s->rc.error == 0; i++) {
+            d[i] = s->rc.read(&s->rc);
+        }
+    }
+    sqz_count(&s->rc, read, n);
+}
+
+static void sqz_put8(struct sqz* s, uint8_t b) {
+    sqz_count(&s->rc, written, 1);
+    s->rc.write(&s->rc, b);
+}
+
+static uint8_t sqz_get8(struct sqz* s) {
+    sqz_count(&s->rc, read, 1);
+    return s->rc.read(&s->rc);
+}
+
+static void sqz_put32(struct sqz* s, uint32_t v) {
+    for (int i = 0; i < 4; i++) { sqz_put8(s, (uint8_t)(v >> (i * 8))); }
+}
+
+static uint32_t sqz_get32(struct sqz* s) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) { v |= (uint32_t)sqz_get8(s) << (i * 8); }
+    return v;
+}
+
+// Tokens are sequences: literal run length followed by run bytes and
+// a back reference. Run lengths of 255 and above are split into 255
+// symbols terminated by a symbol < 255. Each block ends with a run
+// (possibly empty) that is not followed by back reference.
+
+static inline void sqz_literal(struct sqz_block* b, uint8_t byte) {
+    b->byte[b->bytes++] = byte;
+}
+
+static inline void sqz_run(struct sqz_block* b) {
+    uint32_t n = b->bytes - b->run_start;
+    while (n >= 255) { b->run[b->runs++] = 255; n -= 255; }
+    b->run[b->runs++] = (uint8_t)n;
+    b->run_start = b->bytes;
+}
+
+static inline void sqz_match(struct sqz_block* b, uint8_t size,
+                             uint8_t rep, uint8_t bits, uint32_t dist) {
+    sqz_run(b);
+    b->size[b->sizes] = size;
+    b->rep[b->sizes++] = rep;
+    if (rep == 0) {
+        b->bits[b->dists] = bits;
+        b->dist[b->dists++] = dist;
+    }
+}
+
+// Literals are modeled in context of UTF-8 structure of preceding bytes:
+// after a lead byte only continuation bytes are expected (CJK is E4..E9
+// lead followed by two continuation bytes), after complete multibyte
+// sequence next lead of the same script is likely. Splitting contexts
+// further by lead byte value dilutes statistics for no measurable gain.
+
+enum {
+    sqz_utf8_ascii    = 0, // start, after ASCII or invalid byte
+    sqz_utf8_lead2    = 1, // after C0..DF lead
+    sqz_utf8_lead4    = 2, // after F0..F7 lead
+    sqz_utf8_tail     = 3, // last continuation byte of 3 or 4 expected
+    sqz_utf8_next     = 4, // after complete multibyte sequence
+    sqz_utf8_lead3    = 5  // after E0..EF lead
+};
+
+static inline uint32_t sqz_utf8_context(const uint8_t* d, size_t i) {
+    // d[0..i) preceding bytes
+    const uint32_t a = i > 0 ? d[i - 1] : 0;
+    const uint32_t b = i > 1 ? d[i - 2] : 0;
+    const uint32_t c = i > 2 ? d[i - 3] : 0;
+    uint32_t ctx = sqz_utf8_ascii; // F8..FF are never valid in UTF-8
+    if (0xF0 <= a && a < 0xF8) {
+        ctx = sqz_utf8_lead4;
+    } else if (0xE0 <= a && a < 0xF0) {
+        ctx = sqz_utf8_lead3;
+    } else if (0xC0 <= a && a < 0xE0) {
+        ctx = sqz_utf8_lead2;
+    } else if (0x80 <= a && a < 0xC0) {
+        if ((0xE0 <= b && b < 0xF8) || (0xF0 <= c && c < 0xF8)) {
+            ctx = sqz_utf8_tail;
+        } else {
+            ctx = sqz_utf8_next;
+        }
+    }
+    return ctx;
+}
+
+static void sqz_encode_range(struct sqz* s, const uint8_t* d, size_t i) {
+    // d[i] is the first source byte of the block
+    const struct sqz_block* b = &s->block;
+    uint32_t li = 0; // literal index
+    uint32_t mi = 0; // match index
+    uint32_t di = 0; // distance index
+    rc_start(&s->rc);
+    for (uint32_t t = 0; t < b->runs; t++) {
+        rc_encode(&s->rc, &s->pm_run, b->run[t]);
+        for (uint32_t k = 0; k < b->run[t]; k++) {
+            const uint32_t ctx = sqz_utf8_context(d, i++);
+            rc_encode(&s->rc, &s->pm_byte[ctx], b->byte[li++]);
+        }
+        if (b->run[t] < 255 && t + 1 < b->runs) {
+            i += b->size[mi];
+            rc_encode(&s->rc, &s->pm_size, b->size[mi]);
+            rc_encode(&s->rc, &s->pm_rep, b->rep[mi]);
+            if (b->rep[mi++] == 0) {
+                const uint8_t bits = b->bits[di];
+                uint32_t distance = b->dist[di++];
+                rc_encode(&s->rc, &s->pm_bits, bits);
+                for (int k = 0; k < bits - 1; k++) {
+                    rc_encode(&s->rc, &s->pm_dist[k], distance & 0x1);
+                    distance >>= 1;
+                }
+            }
+        }
+    }
+    rc_flush(&s->rc);
+}
+
+// Memory bitstream, most significant bit first, 64-bit shifting buffer.
+// Reading past the end yields zeros and is detected by bs_overrun().
+
+struct bitstream {
+    uint8_t* data;
+    size_t   capacity;
+    size_t   bytes; // number of bytes written or read
+    uint64_t b64;   // bit shifting buffer
+    int32_t  bits;  // bit count inside b64
+    int32_t  error; // sticky E2BIG on writing past capacity
+};
+
+static void bs_init(struct bitstream* bs, uint8_t* data, size_t capacity) {
+    memset(bs, 0, sizeof(*bs));
+    bs->data = data;
+    bs->capacity = capacity;
+}
+
+static inline void bs_output(struct bitstream* bs, int32_t n) { // n bytes
+    if (bs->bytes + n > bs->capacity) {
+        bs->error = E2BIG;
+    } else {
+        for (int32_t i = 0; i < n; i++) {
+            bs->data[bs->bytes++] = (uint8_t)(bs->b64 >> 56);
+            bs->b64 <<= 8;
+        }
+    }
+    bs->bits = bs->bits > n * 8 ? bs->bits - n * 8 : 0;
+}
+
+static inline void bs_write(struct bitstream* bs, uint32_t v, int32_t n) {
+    assert(0 <= n && n <= 32 && bs->bits < 32);
+    assert(n == 32 || (v >> n) == 0);
+    if (n > 0) {
+        bs->b64 |= (uint64_t)v << (64 - bs->bits - n);
+        bs->bits += n;
+        if (bs->bits >= 32) { bs_output(bs, 4); }
+    }
+}
+
+static void bs_flush(struct bitstream* bs) { // pad with zero bits
+    bs_output(bs, (bs->bits + 7) / 8);
+    bs->b64 = 0;
+}
+
+static inline void bs_refill(struct bitstream* bs) {
+    while (bs->bits <= 56) {
+        const uint64_t b = bs->bytes < bs->capacity ? bs->data[bs->bytes] : 0;
+        bs->bytes++;
+        bs->b64 |= b << (56 - bs->bits);
+        bs->bits += 8;
+    }
+}
+
+static inline uint32_t bs_read(struct bitstream* bs, int32_t n) {
+    assert(0 <= n && n <= 32);
+    if (n == 0) { return 0; }
+    if (bs->bits < n) { bs_refill(bs); }
+    const uint32_t v = (uint32_t)(bs->b64 >> (64 - n));
+    bs->b64 <<= n;
+    bs->bits -= n;
+    return v;
+}
+
+static inline bool bs_overrun(const struct bitstream* bs) {
+    return bs->bytes * 8 - bs->bits > bs->capacity * 8;
+}
+
+// Canonical Huffman with code lengths limited to sqz_huffman_bits.
+// Decoding table is indexed by the next sqz_huffman_bits of input and
+// resolves up to two symbols per lookup.
+
+enum { sqz_huffman_bits = 11 };
+
+struct huffman_entry {
+    uint8_t sym[2];
+    uint8_t bits[2]; // bits[0]: first symbol, bits[1]: both or 0
+};
+
+static void huffman_lengths(const uint32_t freq[], uint32_t n, uint8_t len[]) {
+    enum { L = sqz_huffman_bits };
+    uint16_t sorted[256]; // symbols with freq > 0 ascending by freq
+    uint32_t m = 0;
+    memset(len, 0, n);
+    for (uint32_t i = 0; i < n; i++) {
+        if (freq[i] > 0) {
+            uint32_t j = m++;
+            while (j > 0 && freq[sorted[j - 1]] > freq[i]) {
+                sorted[j] = sorted[j - 1];
+                j--;
+            }
+            sorted[j] = (uint16_t)i;
+        }
+    }
+    if (m == 1) { len[sorted[0]] = 1; }
+    if (m <= 1) { return; }
+    // two queues: leaves [0..m-1] and internal nodes [m..2m-2]
+    uint64_t weight[512];
+    uint16_t parent[512];
+    uint8_t  depth[512];
+    for (uint32_t i = 0; i < m; i++) { weight[i] = freq[sorted[i]]; }
+    uint32_t leaf = 0;
+    uint32_t node = m;
+    for (uint32_t k = m; k < 2 * m - 1; k++) {
+        uint32_t pick[2];
+        for (int j = 0; j < 2; j++) {
+            if (leaf < m && (node >= k || weight[leaf] <= weight[node])) {
+                pick[j] = leaf++;
+            } else {
+                pick[j] = node++;
+            }
+        }
+        weight[k] = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = (uint16_t)k;
+        parent[pick[1]] = (uint16_t)k;
+    }
+    depth[2 * m - 2] = 0;
+    uint32_t count[64] = {0}; // number of codes per length
+    for (int32_t k = (int32_t)(2 * m - 3); k >= 0; k--) {
+        depth[k] = depth[parent[k]] + 1;
+        if (k < (int32_t)m) { count[depth[k] < 63 ? depth[k] : 63]++; }
+    }
+    // limit lengths to L keeping Kraft sum == 1 (see deflate encoders)
+    for (uint32_t i = L + 1; i < countof(count); i++) {
+        count[L] += count[i];
+        count[i] = 0;
+    }
+    uint32_t kraft = 0;
+    for (uint32_t i = 1; i <= L; i++) { kraft += count[i] << (L - i); }
+    while (kraft > (1u << L)) {
+        count[L]--;
+        for (uint32_t i = L - 1; i > 0; i--) {
+            if (count[i] > 0) {
+                count[i]--;
+                count[i + 1] += 2;
+                break;
+            }
+        }
+        kraft--;
+    }
+    // least frequent symbols get the longest codes
+    uint32_t k = 0;
+    for (uint32_t i = L; i > 0; i--) {
+        for (uint32_t j = 0; j < count[i]; j++) { len[sorted[k++]] = (uint8_t)i; }
+    }
+}
+
+static bool huffman_codes(const uint8_t len[], uint32_t n, uint16_t code[]) {
+    uint32_t count[sqz_huffman_bits + 1] = {0};
+    for (uint32_t i = 0; i < n; i++) {
+        if (len[i] > sqz_huffman_bits) { return false; }
+        count[len[i]]++;
+    }
+    count[0] = 0;
+    uint32_t next[sqz_huffman_bits + 1] = {0};
+    uint32_t c = 0;
+    uint32_t kraft = 0;
+    for (uint32_t i = 1; i <= sqz_huffman_bits; i++) {
+        c = (c + count[i - 1]) << 1;
+        next[i] = c;
+        kraft += count[i] << (sqz_huffman_bits - i);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        code[i] = len[i] > 0 ? (uint16_t)next[len[i]]++ : 0;
+    }
+    return kraft <= (1u << sqz_huffman_bits);
+}
+
+static void huffman_table(const uint8_t len[], const uint16_t code[],
+                          uint32_t n, struct huffman_entry t[]) {
+    enum { L = sqz_huffman_bits };
+    memset(t, 0, sizeof(t[0]) << L);
+    for (uint32_t i = 0; i < n; i++) {
+        if (len[i] > 0) {
+            const uint32_t from = (uint32_t)code[i] << (L - len[i]);
+            const uint32_t to   = from + (1u << (L - len[i]));
+            for (uint32_t k = from; k < to; k++) {
+                t[k].sym[0] = (uint8_t)i;
+                t[k].bits[0] = len[i];
+            }
+        }
+    }
+    // second symbol: bits after the first code, zero padded, index
+    // the single symbol entries; it is only taken if its whole code
+    // fits into the remaining L - bits[0] bits
+    for (uint32_t k = 0; k < (1u << L); k++) {
+        const uint32_t first = t[k].bits[0];
+        if (first > 0) {
+            const struct huffman_entry* e = &t[(k << first) & ((1u << L) - 1)];
+            const uint32_t bits = first + e->bits[0];
+            if (e->bits[0] > 0 && bits <= L) {
+                t[k].sym[1] = e->sym[0];
+                t[k].bits[1] = (uint8_t)bits;
+            }
+        }
+    }
+}
+
+static void huffman_write_lengths(struct bitstream* bs,
+                                  const uint8_t len[], uint32_t n) {
+    while (n > 0 && len[n - 1] == 0) { n--; }
+    bs_write(bs, n, 16);
+    for (uint32_t i = 0; i < n; i++) { bs_write(bs, len[i], 4); }
+}
+
+static bool huffman_read_lengths(struct bitstream* bs,
+                                 uint8_t len[], uint32_t n) {
+    const uint32_t k = bs_read(bs, 16);
+    if (k > n) { return false; }
+    memset(len, 0, n);
+    for (uint32_t i = 0; i < k; i++) { len[i] = (uint8_t)bs_read(bs, 4); }
+    return true;
+}
+
+static void huffman_decode(struct bitstream* bs, const struct huffman_entry t[],
+                           uint8_t sym[], uint32_t count, int32_t* error) {
+    enum { L = sqz_huffman_bits };
+    uint32_t i = 0;
+    while (i + 1 < count) {
+        if (bs->bits < L) { bs_refill(bs); }
+        const struct huffman_entry* e = &t[bs->b64 >> (64 - L)];
+        if (e->bits[0] == 0) { *error = EILSEQ; return; }
+        sym[i++] = e->sym[0];
+        if (e->bits[1] != 0) {
+            sym[i++] = e->sym[1];
+            bs->b64 <<= e->bits[1];
+            bs->bits -= e->bits[1];
+        } else {
+            bs->b64 <<= e->bits[0];
+            bs->bits -= e->bits[0];
+        }
+    }
+    if (i < count) {
+        if (bs->bits < L) { bs_refill(bs); }
+        const struct huffman_entry* e = &t[bs->b64 >> (64 - L)];
+        if (e->bits[0] == 0) { *error = EILSEQ; return; }
+        sym[i++] = e->sym[0];
+        bs->b64 <<= e->bits[0];
+        bs->bits -= e->bits[0];
+    }
+}
+
+// Huffman block payload: uint32_t runs count, code lengths of
+// run, byte, size, rep, bits classes, all symbols of each class in
+// that order followed by (bits - 1) low bits of each distance.
+
+enum { sqz_classes = 5 };
+
+static const uint32_t sqz_class_n[sqz_classes] = { 256, 256, 256, 5, 32 };
+
+static void sqz_classes_of(struct sqz_block* b, uint8_t* sym[],
+                           uint32_t count[]) {
+    sym[0] = b->run;  count[0] = b->runs;
+    sym[1] = b->byte; count[1] = b->bytes;
+    sym[2] = b->size; count[2] = b->sizes;
+    sym[3] = b->rep;  count[3] = b->sizes;
+    sym[4] = b->bits; count[4] = b->dists;
+}
+
+static size_t sqz_encode_huffman(struct sqz* s, size_t capacity) {
+    struct sqz_block* b = &s->block;
+    uint8_t* sym[sqz_classes];
+    uint32_t count[sqz_classes];
+    sqz_classes_of(b, sym, count);
+    uint8_t  len[sqz_classes][256];
+    uint16_t code[sqz_classes][256];
+    struct bitstream bs;
+    bs_init(&bs, b->data, capacity);
+    bs_write(&bs, b->runs, 32);
+    for (int c = 0; c < sqz_classes; c++) {
+        uint32_t freq[256] = {0};
+        for (uint32_t i = 0; i < count[c]; i++) { freq[sym[c][i]]++; }
+        huffman_lengths(freq, sqz_class_n[c], len[c]);
+        huffman_codes(len[c], sqz_class_n[c], code[c]);
+        huffman_write_lengths(&bs, len[c], sqz_class_n[c]);
+    }
+    for (int c = 0; c < sqz_classes && bs.error == 0; c++) {
+        const uint8_t*  l = len[c];
+        const uint16_t* k = code[c];
+        for (uint32_t i = 0; i < count[c]; i++) {
+            bs_write(&bs, k[sym[c][i]], l[sym[c][i]]);
+        }
+    }
+    for (uint32_t i = 0; i < b->dists && bs.error == 0; i++) {
+        const int32_t n = b->bits[i] - 1;
+        bs_write(&bs, b->dist[i] & ((1u << n) - 1), n);
+    }
+    bs_flush(&bs);
+    return bs.error == 0 ? bs.bytes : 0;
+}
+
+static bool sqz_copy(struct sqz* s, uint8_t* d, size_t* i, size_t end,
+                     uint8_t size, uint32_t dist) {
+    if (size < sqz_min_len || size > sqz_max_len) {
+        s->rc.error = ERANGE;
+    } else if (*i < dist || dist == 0) {
+        s->rc.error = ERANGE;
+    } else if (*i + size > end) {
+        s->rc.error = EILSEQ;
+    } else {
+        // memcpy() cannot be used on overlapped regions
+        // because it may read more than one byte at a time.
+        const size_t n = *i + size;
+        if (dist == 1) { // run of the same byte
+            memset(d + *i, d[*i - 1], size);
+        } else {
+            uint8_t* p = d - (size_t)dist;
+            size_t k = *i;
+            while (k < n) { d[k] = p[k]; k++; }
+        }
+        *i = n;
+    }
+    return s->rc.error == 0;
+}
+
+static void rc_prefetch(struct range_coder* rc) {
+    rc_start(rc);
+    rc->code = 0;  // read first 8 bytes
+    for (size_t k = 0; k < sizeof(rc->code); k++) {
+        sqz_count_read(rc);
+        rc->code = (rc->code << 8) + rc->read(rc);
+    }
+}
+
+static void sqz_decode_range(struct sqz* s, uint8_t* d, size_t i, size_t end) {
+    rc_prefetch(&s->rc);
+    while (s->rc.error == 0) {
+        const uint8_t run = rc_decode(&s->rc, &s->pm_run);
+        if (s->rc.error != 0) { break; }
+        if (run > end - i) { s->rc.error = EILSEQ; break; }
+        for (uint32_t k = 0; k < run; k++) {
+            const uint32_t ctx = sqz_utf8_context(d, i);
+            d[i++] = rc_decode(&s->rc, &s->pm_byte[ctx]);
+        }
+        if (run == 255) { continue; }
+        if (i == end) { break; } // last run of the block
+        const uint8_t size = rc_decode(&s->rc, &s->pm_size);
+        const uint8_t rep  = rc_decode(&s->rc, &s->pm_rep);
+        if (s->rc.error != 0) { break; }
+        uint32_t dist = 0;
+        if (rep > countof(s->rep)) {
+            s->rc.error = EILSEQ;
+        } else if (rep > 0) {
+            dist = s->rep[rep - 1];
+        } else {
+            uint8_t bits = rc_decode(&s->rc, &s->pm_bits);
+            for (int b = 0; b < bits - 1 && s->rc.error == 0; b++) {
+                dist |= (uint32_t)rc_decode(&s->rc, &s->pm_dist[b]) << b;
+            }
+            if (bits > 0) { dist |= (1u << (bits - 1)); }
+        }
+        if (s->rc.error == 0) {
+            sqz_rep_update(s->rep, rep, dist);
+            sqz_copy(s, d, &i, end, size, dist);
+        }
+    }
+}
+
+// Counts of byte, size and rep classes follow from decoded runs,
+// count of bits class follows from decoded reps:
+
+static bool sqz_count_literals(struct sqz_block* b) {
+    uint32_t terminated = 0;
+    b->bytes = 0;
+    for (uint32_t t = 0; t < b->runs; t++) {
+        b->bytes += b->run[t];
+        terminated += b->run[t] < 255;
+    }
+    b->sizes = terminated > 0 ? terminated - 1 : 0;
+    return b->runs > 0 && b->run[b->runs - 1] < 255 &&
+           b->bytes <= b->capacity && b->sizes <= b->capacity / 2;
+}
+
+static void sqz_count_dists(struct sqz_block* b) {
+    b->dists = 0;
+    for (uint32_t t = 0; t < b->sizes; t++) { b->dists += b->rep[t] == 0; }
+}
+
+static void sqz_decode_tokens(struct sqz* s, uint8_t* d, size_t i,
+                              size_t end, struct bitstream* bs) {
+    // bs: (bits - 1) low bits of each explicit distance
+    //     or null if b->dist[] is already decoded
+    const struct sqz_block* b = &s->block;
+    uint32_t li = 0; // literal index
+    uint32_t mi = 0; // match index
+    uint32_t di = 0; // distance index
+    for (uint32_t t = 0; t < b->runs && s->rc.error == 0; t++) {
+        const uint8_t run = b->run[t];
+        if (run > end - i || run > b->bytes - li) {
+            s->rc.error = EILSEQ;
+            break;
+        }
+        memcpy(d + i, b->byte + li, run);
+        i  += run;
+        li += run;
+        if (run == 255 || t + 1 == b->runs) { continue; }
+        const uint8_t size = b->size[mi];
+        const uint8_t rep  = b->rep[mi++];
+        uint32_t dist = 0;
+        if (rep > countof(s->rep)) {
+            s->rc.error = EILSEQ;
+        } else if (rep > 0) {
+            dist = s->rep[rep - 1];
+        } else {
+            const uint8_t bits = b->bits[di++];
+            if (bits == 0) {
+                s->rc.error = EILSEQ;
+            } else if (bs == null) {
+                dist = b->dist[di - 1];
+            } else {
+                dist = bs_read(bs, bits - 1) | (1u << (bits - 1));
+            }
+        }
+        if (s->rc.error == 0) {
+            sqz_rep_update(s->rep, rep, dist);
+            sqz_copy(s, d, &i, end, size, dist);
+        }
+    }
+    if (s->rc.error == 0 && i != end) { s->rc.error = EILSEQ; }
+    if (s->rc.error == 0 && bs != null && bs_overrun(bs)) {
+        s->rc.error = EILSEQ;
+    }
+}
+
+static void sqz_decode_huffman(struct sqz* s, uint8_t* d, size_t i,
+                               size_t end, size_t payload) {
+    struct sqz_block* b = &s->block;
+    struct bitstream bs;
+    bs_init(&bs, b->data, payload);
+    uint8_t  len[sqz_classes][256];
+    b->runs = bs_read(&bs, 32);
+    bool ok = b->runs <= b->capacity;
+    for (int c = 0; c < sqz_classes && ok; c++) {
+        ok = huffman_read_lengths(&bs, len[c], sqz_class_n[c]);
+    }
+    struct huffman_entry table[1u << sqz_huffman_bits];
+    uint16_t code[256];
+    for (int c = 0; c < sqz_classes && ok && s->rc.error == 0; c++) {
+        uint8_t* sym[sqz_classes];
+        uint32_t count[sqz_classes];
+        if (c == 1) { ok = sqz_count_literals(b); }
+        if (c == 4) { sqz_count_dists(b); }
+        sqz_classes_of(b, sym, count);
+        ok = ok && huffman_codes(len[c], sqz_class_n[c], code);
+        if (ok && count[c] > 0) {
+            huffman_table(len[c], code, sqz_class_n[c], table);
+            huffman_decode(&bs, table, sym[c], count[c], &s->rc.error);
+        }
+    }
+    if (!ok) { s->rc.error = EILSEQ; }
+    sqz_decode_tokens(s, d, i, end, &bs);
+}
+
+// rANS with 4 interleaved 32-bit states, 16-bit renormalization and
+// static per-block frequencies quantized to 2^rans_scale_bits:
+// https://arxiv.org/abs/1311.2540 https://github.com/rygorous/ryg_rans
+// rANS block payload: uint32_t runs count, frequencies of all classes,
+// (byte aligned) for each non empty class 4 final states followed by
+// 16-bit words in decoding order, then distance bits as in Huffman block.
+
+enum { rans_scale_bits = 12, rans_scale = 1u << rans_scale_bits };
+enum { rans_low = 1u << 16 }; // states are in [rans_low, rans_low << 16)
+
+static void rans_quantize(const uint32_t freq[], uint32_t n, uint32_t total,
+                          uint16_t q[]) {
+    uint32_t sum = 0;
+    uint32_t top = 0; // most frequent symbol
+    for (uint32_t i = 0; i < n; i++) {
+        q[i] = 0;
+        if (freq[i] > 0) {
+            const uint64_t v = (uint64_t)freq[i] * rans_scale / total;
+            q[i] = (uint16_t)(v > 0 ? v : 1);
+            sum += q[i];
+            if (freq[i] > freq[top]) { top = i; }
+        }
+    }
+    if (sum < rans_scale) { q[top] += (uint16_t)(rans_scale - sum); }
+    while (sum > rans_scale) { // take from the largest frequencies
+        uint32_t m = 0;
+        for (uint32_t i = 1; i < n; i++) { if (q[i] > q[m]) { m = i; } }
+        const uint32_t take = sum - rans_scale < q[m] / 2u ?
+                              sum - rans_scale : q[m] / 2u;
+        q[m] -= (uint16_t)take;
+        sum -= take;
+    }
+}
+
+static void rans_write_freq(struct bitstream* bs, const uint16_t q[],
+                            uint32_t n) {
+    while (n > 0 && q[n - 1] == 0) { n--; }
+    bs_write(bs, n, 16);
+    for (uint32_t i = 0; i < n; i++) {
+        bs_write(bs, q[i] > 0, 1);
+        if (q[i] > 0) { bs_write(bs, q[i] - 1u, rans_scale_bits); }
+    }
+}
+
+static bool rans_read_freq(struct bitstream* bs, uint16_t q[], uint32_t n) {
+    const uint32_t k = bs_read(bs, 16);
+    if (k > n) { return false; }
+    memset(q, 0, n * sizeof(q[0]));
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < k; i++) {
+        if (bs_read(bs, 1)) { q[i] = (uint16_t)(bs_read(bs, rans_scale_bits) + 1); }
+        sum += q[i];
+    }
+    return k == 0 || sum == rans_scale;
+}
+
+static size_t rans_encode(const uint8_t sym[], uint32_t count,
+                          const uint16_t q[], uint32_t n,
+                          uint8_t* data, size_t capacity) {
+    // words are written backwards from data + capacity then moved
+    // to data + 16 after 4 final states
+    if (capacity < 16) { return 0; }
+    uint32_t c[257];
+    c[0] = 0;
+    for (uint32_t i = 0; i < n; i++) { c[i + 1] = c[i] + q[i]; }
+    uint32_t x[4] = { rans_low, rans_low, rans_low, rans_low };
+    uint8_t* p = data + capacity;
+    for (uint32_t i = count; i > 0; i--) {
+        const uint8_t  s = sym[i - 1];
+        const uint32_t f = q[s];
+        uint32_t* xj = &x[(i - 1) & 3];
+        const uint64_t x_max = (uint64_t)f << (32 - rans_scale_bits);
+        if (*xj >= x_max) {
+            if (p - 2 < data + 16) { return 0; }
+            p -= 2;
+            p[0] = (uint8_t)(*xj);
+            p[1] = (uint8_t)(*xj >> 8);
+            *xj >>= 16;
+        }
+        *xj = ((*xj / f) << rans_scale_bits) + (*xj % f) + c[s];
+    }
+    for (int j = 0; j < 4; j++) {
+        for (int k = 0; k < 4; k++) { data[j * 4 + k] = (uint8_t)(x[j] >> (k * 8)); }
+    }
+    const size_t words = (size_t)(data + capacity - p);
+    memmove(data + 16, p, words);
+    return 16 + words;
+}
+
+static size_t rans_decode(const uint8_t* data, size_t bytes,
+                          const uint16_t q[], uint32_t n,
+                          uint8_t sym[], uint32_t count) {
+    // returns number of bytes consumed or 0 on error
+    uint8_t  slot[rans_scale];
+    uint16_t c[256];
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        c[i] = (uint16_t)k;
+        memset(slot + k, (int)i, q[i]);
+        k += q[i];
+    }
+    if (bytes < 16 || k != rans_scale) { return 0; }
+    uint32_t x[4];
+    for (int j = 0; j < 4; j++) {
+        x[j] = (uint32_t)data[j * 4] | ((uint32_t)data[j * 4 + 1] << 8) |
+              ((uint32_t)data[j * 4 + 2] << 16) | ((uint32_t)data[j * 4 + 3] << 24);
+    }
+    const uint8_t* p = data + 16;
+    const uint8_t* e = data + bytes;
+    const uint32_t mask = rans_scale - 1;
+    #define rans_step(j) do {                                     \
+        const uint32_t m = x[j] & mask;                           \
+        const uint8_t  s = slot[m];                               \
+        sym[i + (j)] = s;                                         \
+        x[j] = q[s] * (x[j] >> rans_scale_bits) + m - c[s];       \
+        if (x[j] < rans_low) {                                    \
+            if (p + 2 > e) { return 0; }                          \
+            x[j] = (x[j] << 16) | p[0] | ((uint32_t)p[1] << 8);   \
+            p += 2;                                               \
+        }                                                         \
+    } while (0)
+    uint32_t i = 0;
+    while (i + 4 <= count) {
+        rans_step(0); rans_step(1); rans_step(2); rans_step(3);
+        i += 4;
+    }
+    for (uint32_t j = 0; i + j < count; j++) { rans_step(j); }
+    #undef rans_step
+    return (size_t)(p - data);
+}
+
+static size_t sqz_encode_rans(struct sqz* s, size_t capacity) {
+    struct sqz_block* b = &s->block;
+    uint8_t* sym[sqz_classes];
+    uint32_t count[sqz_classes];
+    sqz_classes_of(b, sym, count);
+    uint16_t q[sqz_classes][256];
+    struct bitstream bs;
+    bs_init(&bs, b->data, capacity);
+    bs_write(&bs, b->runs, 32);
+    for (int c = 0; c < sqz_classes; c++) {
+        uint32_t freq[256] = {0};
+        for (uint32_t i = 0; i < count[c]; i++) { freq[sym[c][i]]++; }
+        if (count[c] > 0) {
+            rans_quantize(freq, sqz_class_n[c], count[c], q[c]);
+        } else {
+            memset(q[c], 0, sizeof(q[c]));
+        }
+        rans_write_freq(&bs, q[c], sqz_class_n[c]);
+    }
+    bs_flush(&bs);
+    if (bs.error != 0) { return 0; }
+    size_t pos = bs.bytes;
+    for (int c = 0; c < sqz_classes; c++) {
+        if (count[c] > 0) {
+            size_t k = rans_encode(sym[c], count[c], q[c], sqz_class_n[c],
+                                   b->data + pos, capacity - pos);
+            if (k == 0) { return 0; }
+            pos += k;
+        }
+    }
+    bs_init(&bs, b->data + pos, capacity - pos);
+    for (uint32_t i = 0; i < b->dists && bs.error == 0; i++) {
+        const int32_t n = b->bits[i] - 1;
+        bs_write(&bs, b->dist[i] & ((1u << n) - 1), n);
+    }
+    bs_flush(&bs);
+    return bs.error == 0 ? pos + bs.bytes : 0;
+}
+
+static void sqz_decode_rans(struct sqz* s, uint8_t* d, size_t i,
+                            size_t end, size_t payload) {
+    struct sqz_block* b = &s->block;
+    struct bitstream bs;
+    bs_init(&bs, b->data, payload);
+    uint16_t q[sqz_classes][256];
+    b->runs = bs_read(&bs, 32);
+    bool ok = b->runs <= b->capacity;
+    for (int c = 0; c < sqz_classes && ok; c++) {
+        ok = rans_read_freq(&bs, q[c], sqz_class_n[c]);
+    }
+    size_t pos = (bs.bytes * 8 - bs.bits + 7) / 8; // byte aligned
+    for (int c = 0; c < sqz_classes && ok; c++) {
+        uint8_t* sym[sqz_classes];
+        uint32_t count[sqz_classes];
+        if (c == 1) { ok = sqz_count_literals(b); }
+        if (c == 4) { sqz_count_dists(b); }
+        sqz_classes_of(b, sym, count);
+        if (ok && count[c] > 0) {
+            const size_t k = pos <= payload ?
+                rans_decode(b->data + pos, payload - pos, q[c],
+                            sqz_class_n[c], sym[c], count[c]) : 0;
+            ok = k > 0;
+            pos += k;
+        }
+    }
+    if (!ok) {
+        s->rc.error = EILSEQ;
+    } else {
+        bs_init(&bs, b->data + pos, payload - pos);
+        sqz_decode_tokens(s, d, i, end, &bs);
+    }
+}
+
+// Split blocks: each symbol class is range coded into its own sub-stream
+// with its own models, restarted at each block. Explicit distances
+// (pm_bits symbol followed by pm_dist bits) form the last sub-stream.
+// Payload header is 4 class counts and 5 sub-stream lengths, so the
+// decoder may decode sub-streams independently (in any order or in
+// parallel) and then interleave tokens.
+
+enum { sqz_split_streams = 5, sqz_split_header = (4 + sqz_split_streams) * 4 };
+
+struct rc_memory { // range coder over block sub-stream
+    struct range_coder rc;
+    uint8_t* data;
+    size_t   capacity;
+    size_t   bytes;
+};
+
+static void rc_memory_write(struct range_coder* rc, uint8_t b) {
+    struct rc_memory* m = (struct rc_memory*)rc;
+    if (m->bytes < m->capacity) {
+        m->data[m->bytes++] = b;
+    } else {
+        rc->error = E2BIG;
+    }
+}
+
+static uint8_t rc_memory_read(struct range_coder* rc) {
+    struct rc_memory* m = (struct rc_memory*)rc;
+    if (m->bytes < m->capacity) { return m->data[m->bytes++]; }
+    return rc_err(rc, EILSEQ);
+}
+
+static void rc_memory_init(struct rc_memory* m, uint8_t* data, size_t capacity) {
+    memset(m, 0, sizeof(*m));
+    rc_init(&m->rc, 0);
+    m->rc.write = rc_memory_write;
+    m->rc.read  = rc_memory_read;
+    m->data     = data;
+    m->capacity = capacity;
+}
+
+static inline void sqz_store32(uint8_t* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) { p[i] = (uint8_t)(v >> (i * 8)); }
+}
+
+static inline uint32_t sqz_load32(const uint8_t* p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) { v |= (uint32_t)p[i] << (i * 8); }
+    return v;
+}
+
+static void sqz_encode_stream(struct sqz* s, struct range_coder* rc, int c) {
+    const struct sqz_block* b = &s->block;
+    if (c == 0) {
+        for (uint32_t i = 0; i < b->runs; i++) {
+            rc_encode(rc, &s->pm_run, b->run[i]);
+        }
+    } else if (c == 1) {
+        // order-0: source bytes preceding literals are not known
+        // until the tokens are decoded
+        for (uint32_t i = 0; i < b->bytes; i++) {
+            rc_encode(rc, &s->pm_byte[sqz_utf8_ascii], b->byte[i]);
+        }
+    } else if (c == 2) {
+        for (uint32_t i = 0; i < b->sizes; i++) {
+            rc_encode(rc, &s->pm_size, b->size[i]);
+        }
+    } else if (c == 3) {
+        for (uint32_t i = 0; i < b->sizes; i++) {
+            rc_encode(rc, &s->pm_rep, b->rep[i]);
+        }
+    } else {
+        for (uint32_t i = 0; i < b->dists; i++) {
+            const uint8_t bits = b->bits[i];
+            uint32_t distance = b->dist[i];
+            rc_encode(rc, &s->pm_bits, bits);
+            for (int k = 0; k < bits - 1; k++) {
+                rc_encode(rc, &s->pm_dist[k], distance & 0x1);
+                distance >>= 1;
+            }
+        }
+    }
+}
+
+static void sqz_decode_stream(struct sqz* s, struct range_coder* rc, int c) {
+    struct sqz_block* b = &s->block;
+    if (c == 0) {
+        for (uint32_t i = 0; i < b->runs && rc->error == 0; i++) {
+            b->run[i] = rc_decode(rc, &s->pm_run);
+        }
+    } else if (c == 1) {
+        for (uint32_t i = 0; i < b->bytes && rc->error == 0; i++) {
+            b->byte[i] = rc_decode(rc, &s->pm_byte[sqz_utf8_ascii]);
+        }
+    } else if (c == 2) {
+        for (uint32_t i = 0; i < b->sizes && rc->error == 0; i++) {
+            b->size[i] = rc_decode(rc, &s->pm_size);
+        }
+    } else if (c == 3) {
+        for (uint32_t i = 0; i < b->sizes && rc->error == 0; i++) {
+            b->rep[i] = rc_decode(rc, &s->pm_rep);
+        }
+    } else {
+        for (uint32_t i = 0; i < b->dists && rc->error == 0; i++) {
+            const uint8_t bits = rc_decode(rc, &s->pm_bits);
+            uint32_t dist = 0;
+            for (int k = 0; k < bits - 1 && rc->error == 0; k++) {
+                dist |= (uint32_t)rc_decode(rc, &s->pm_dist[k]) << k;
+            }
+            b->bits[i] = bits;
+            b->dist[i] = bits > 0 ? dist | (1u << (bits - 1)) : 0;
+        }
+    }
+}
+
+static size_t sqz_encode_split(struct sqz* s, size_t capacity) {
+    struct sqz_block* b = &s->block;
+    if (capacity < sqz_split_header) { return 0; }
+    sqz_init_models(s);
+    const uint32_t count[4] = { b->runs, b->bytes, b->sizes, b->dists };
+    for (int k = 0; k < 4; k++) { sqz_store32(b->data + k * 4, count[k]); }
+    size_t pos = sqz_split_header;
+    for (int c = 0; c < sqz_split_streams; c++) {
+        struct rc_memory m;
+        rc_memory_init(&m, b->data + pos, capacity - pos);
+        m.rc.counters = s->rc.counters;
+        sqz_encode_stream(s, &m.rc, c);
+        rc_flush(&m.rc);
+        if (m.rc.error != 0) { return 0; }
+        sqz_store32(b->data + 16 + c * 4, (uint32_t)m.bytes);
+        pos += m.bytes;
+    }
+    return pos;
+}
+
+static void sqz_decode_split(struct sqz* s, uint8_t* d, size_t i,
+                             size_t end, size_t payload) {
+    struct sqz_block* b = &s->block;
+    bool ok = payload >= sqz_split_header;
+    if (ok) {
+        b->runs  = sqz_load32(b->data + 0);
+        b->bytes = sqz_load32(b->data + 4);
+        b->sizes = sqz_load32(b->data + 8);
+        b->dists = sqz_load32(b->data + 12);
+        ok = b->runs <= b->capacity && b->bytes <= end - i &&
+             b->sizes <= b->capacity / 2 && b->dists <= b->sizes;
+    }
+    sqz_init_models(s);
+    size_t pos = sqz_split_header;
+    for (int c = 0; c < sqz_split_streams && ok; c++) {
+        const uint32_t length = sqz_load32(b->data + 16 + c * 4);
+        ok = length <= payload - pos;
+        if (ok) {
+            struct rc_memory m;
+            rc_memory_init(&m, b->data + pos, length);
+            m.rc.counters = s->rc.counters;
+            rc_prefetch(&m.rc);
+            sqz_decode_stream(s, &m.rc, c);
+            ok = m.rc.error == 0;
+            pos += length;
+        }
+    }
+    if (ok) { // decoded runs and reps must agree with header counts
+        const uint32_t bytes = b->bytes;
+        const uint32_t dists = b->dists;
+        const uint32_t sizes = b->sizes;
+        ok = sqz_count_literals(b) && b->bytes == bytes && b->sizes == sizes;
+        sqz_count_dists(b);
+        ok = ok && b->dists == dists;
+    }
+    if (!ok) {
+        s->rc.error = EILSEQ;
+    } else {
+        sqz_decode_tokens(s, d, i, end, null);
+    }
+}
+
+// Incompressible blocks (compressed media, encrypted payloads) are
+// detected by order-0 entropy of every sqz_sample_step-th byte and are
+// stored without parsing and entropy coding.
+
+enum { sqz_sample_step = 4, sqz_sample_min = 4096 };
+
+static double sqz_sample_entropy(const uint32_t freq[256], uint32_t n) {
+    // order-0 entropy in bits per byte of n samples
+    if (n == 0) { return 0; }
+    double e = 0;
+    int32_t k = 0; // number of distinct bytes
+    for (int i = 0; i < 256; i++) {
+        if (freq[i] > 0) {
+            const double p = (double)freq[i] / n;
+            e -= p * log2(p);
+            k++;
+        }
+    }
+    // Miller-Madow correction of the sample size bias:
+    return e + (k - 1) / (2.0 * n * log(2.0));
+}
+
+static double sqz_block_entropy(const uint8_t* d, size_t bytes) {
+    uint32_t freq[256] = {0};
+    uint32_t n = 0;
+    for (size_t i = 0; i < bytes; i += sqz_sample_step) { freq[d[i]]++; n++; }
+    return sqz_sample_entropy(freq, n);
+}
+
+static bool sqz_incompressible(const uint8_t* d, size_t bytes) {
+    return bytes >= sqz_sample_min && sqz_block_entropy(d, bytes) > 7.95;
+}
+
+// Trace
+
+uint64_t sqz_trace_time(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000uLL + (uint64_t)ts.tv_nsec;
+}
+
+void sqz_trace_add(struct sqz_trace* t, int32_t phase, uint64_t start,
+                   uint64_t in, uint64_t out) {
+    assert(0 <= phase && phase < sqz_phases);
+    const uint64_t end = sqz_trace_time();
+    if (t->count < t->capacity) {
+        struct sqz_trace_event* e = &t->event[t->count++];
+        e->start = start;
+        e->end   = end;
+        e->in    = in;
+        e->out   = out;
+        e->block = t->block;
+        e->phase = phase;
+    } else {
+        t->dropped++;
+    }
+    t->mark = end;
+}
+
+static void sqz_json(char* json, size_t capacity, size_t* at,
+                     const char* format, ...) {
+    va_list va;
+    va_start(va, format);
+    char* p = *at < capacity ? json + *at : null;
+    const int r = vsnprintf(p, p != null ? capacity - *at : 0, format, va);
+    va_end(va);
+    if (r > 0) { *at += (size_t)r; }
+}
+
+size_t sqz_trace_json(struct sqz_trace* const trace[], size_t n,
+                      char* json, size_t capacity) {
+    static const char* name[sqz_phases] = {
+        "find", "encode", "store", "checksum", "decode", "filter", "wait"
+    };
+    uint64_t origin = UINT64_MAX;
+    for (size_t k = 0; k < n; k++) {
+        for (uint32_t i = 0; i < trace[k]->count; i++) {
+            if (trace[k]->event[i].start < origin) {
+                origin = trace[k]->event[i].start;
+            }
+        }
+    }
+    size_t at = 0;
+    const char* separator = "";
+    sqz_json(json, capacity, &at, "{\"traceEvents\":[");
+    for (size_t k = 0; k < n; k++) {
+        const struct sqz_trace* t = trace[k];
+        for (uint32_t i = 0; i < t->count; i++) {
+            const struct sqz_trace_event* e = &t->event[i];
+            sqz_json(json, capacity, &at, "%s\n{\"name\":\"%s\","
+                "\"cat\":\"sqz\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"block\":%u,"
+                "\"in\":%llu,\"out\":%llu}}", separator, name[e->phase],
+                t->tid, (e->start - origin) / 1000.0,
+                (e->end - e->start) / 1000.0, e->block,
+                (unsigned long long)e->in, (unsigned long long)e->out);
+            separator = ",";
+        }
+    }
+    sqz_json(json, capacity, &at, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    return at;
+}
+
+static size_t sqz_trace_written(struct sqz* s) {
+    // bytes written so far are only known for frame blocks
+    return s->rc.write == sqz_memory_write ?
+           ((struct sqz_memory*)s->that)->bytes : 0;
+}
+
+static void sqz_encode_stored(struct sqz* s, const uint8_t* d, size_t bytes) {
+    sqz_put8(s, sqz_stored);
+    sqz_put32(s, (uint32_t)bytes);
+    sqz_write_bytes(s, d, bytes);
+}
+
+static void sqz_encode_block(struct sqz* s, const uint8_t* source,
+                             size_t start, size_t bytes) {
+    const uint8_t* d = source + start;
+    const uint64_t t0 = sqz_clock(&s->rc);
+    struct sqz_trace* tr = s->trace;
+    const size_t written = tr != null ? sqz_trace_written(s) : 0;
+    if (tr != null) { sqz_trace_add(tr, sqz_phase_find, tr->mark, bytes, 0); }
+    size_t payload = 0;
+    sqz_run(&s->block); // last run of the block
+    // not worth it if larger than source:
+    if (s->backend == sqz_huffman) {
+        payload = sqz_encode_huffman(s, bytes);
+    } else if (s->backend == sqz_rans) {
+        payload = sqz_encode_rans(s, bytes);
+    } else if (s->backend == sqz_split) {
+        payload = sqz_encode_split(s, bytes);
+    }
+    if (payload == 0 && s->backend == sqz_split) {
+        // decoder will not see the tokens, restore rep[] it will have
+        memcpy(s->rep, s->block.rep_start, sizeof(s->rep));
+        sqz_encode_stored(s, d, bytes);
+    } else if (payload > 0) {
+        sqz_put8(s, (uint8_t)s->backend);
+        sqz_put32(s, (uint32_t)bytes);
+        sqz_put32(s, (uint32_t)payload);
+        sqz_write_bytes(s, s->block.data, payload);
+    } else {
+        sqz_put8(s, sqz_range);
+        sqz_put32(s, (uint32_t)bytes);
+        sqz_encode_range(s, source, start);
+    }
+    s->block.runs = 0;
+    s->block.run_start = 0;
+    s->block.bytes = 0;
+    s->block.sizes = 0;
+    s->block.dists = 0;
+    memcpy(s->block.rep_start, s->rep, sizeof(s->rep));
+    sqz_timed(&s->rc, sqz_stage_encode, t0);
+    if (tr != null) {
+        sqz_trace_add(tr, sqz_phase_encode, tr->mark, bytes,
+                      sqz_trace_written(s) - written);
+    }
+}
+
+void sqz_compress(struct sqz* s, const void* memory, size_t bytes, uint32_t window) {
+s->map.n = 0;
+    static_assert(sizeof(size_t) == 4 || sizeof(size_t) == 8, "32|64 only");
+    if (bytes > (uint64_t)INT32_MAX && sizeof(size_t) == 4) {
+        s->rc.error = E2BIG;
+        return;
+    }
+    if (s->level < 0 || s->level > sqz_max_level) {
+        s->rc.error = EINVAL;
+        return;
+    }
+    const uint8_t* d = (const uint8_t*)memory;
+    // contexts without match finder memory are limited to rep matches:
+    const uint32_t depth = s->level > 0 && s->chain.head != null ?
+                           1u << (s->level - 1) : 0;
+    if (depth > 0) { chain_start(&s->chain, bytes); }
+    #ifdef SQZ_INSTRUMENT // find ticks are total less encode ticks:
+        const uint64_t t0 = sqz_clock(&s->rc);
+        const uint64_t encode = s->rc.counters != null ?
+            s->rc.counters->ticks[sqz_stage_encode] : 0;
+    #endif
+    size_t i = 0;
+    size_t start = 0; // of the current block
+    struct sqz_stats* st = s->stats; // null unless caller opted in
+    struct sqz_trace* tr = s->trace;
+    if (tr != null) { tr->mark = sqz_trace_time(); }
+    while (i < bytes && s->rc.error == 0) {
+//      const size_t maximum = bytes - i < sqz_max_len ? bytes - i : sqz_max_len;
+        // back references do not cross the end of the block:
+        const size_t end = bytes - start < s->block.capacity ?
+                           bytes : start + s->block.capacity;
+        if (i == start && sqz_incompressible(d + start, end - start)) {
+            sqz_encode_stored(s, d + start, end - start);
+            if (st != null) { st->literals += end - start; }
+            if (tr != null) {
+                sqz_trace_add(tr, sqz_phase_store, tr->mark, end - start,
+                              end - start);
+            }
+            i = end;
+            start = end;
+            continue;
+        }
+        const size_t run = i > 0 ? sqz_run_length(d, i, end) : 0;
+        if (run >= sqz_min_run) {
+            const size_t last = i + run;
+            if (depth > 0) { chain_insert(&s->chain, d, i, bytes); }
+            while (last - i >= sqz_min_len) {
+                const size_t n = last - i < sqz_max_len ? last - i : sqz_max_len;
+                uint8_t rep_index = 0;
+                for (uint8_t r = 0; r < countof(s->rep) && rep_index == 0; r++) {
+                    if (s->rep[r] == 1) { rep_index = r + 1; }
+                }
+                sqz_match(&s->block, (uint8_t)n, rep_index, sqz_bits_of(1), 1);
+                sqz_rep_update(s->rep, rep_index, 1);
+                if (st != null) {
+                    st->size[n]++;
+                    st->distance_bits[1]++;
+                    if (rep_index > 0) { st->rep_matches++; }
+                    st->matched += n;
+                }
+                i += n;
+            }
+            // the run tail followed by the next bytes is worth finding:
+            for (size_t k = i - 3; k < i && depth > 0; k++) {
+                chain_insert(&s->chain, d, k, bytes);
+            }
+            if (i == end) {
+                sqz_encode_block(s, d, start, end - start);
+                start = end;
+            }
+            continue;
+        }
+        uint8_t  map_size = 0;
+        uint32_t map_dist = 0;
+        if (s->map.n > 0) {
+            // Use map_best() before O(n) LZ search
+            map_best(s, d + i, end - i, &map_dist, &map_size, window);
+            if (map_size >= sqz_min_len && st != null) {
+                st->map_distance += map_dist;
+                st->map_size += map_size;
+                st->map_matches++;
+            }
+        }
+
+#undef  SQZ_NO_COMPARE_TO_LZ77
+#define SQZ_NO_COMPARE_TO_LZ77
+
+#ifndef SQZ_NO_COMPARE_TO_LZ77
+        uint8_t  lz77_size = map_size;
+        uint32_t lz77_dist = map_dist;
+        // Perform O(n) LZ search only if map_best() didn't find a match
+        if (map_size < sqz_min_len && i >= 1) {
+            size_t j = i - 1;
+            size_t min_j = i >= window ? i - window + 1 : 0;
+            for (;;) {
+                const size_t n = bytes - i;
+                size_t k = 0;
+                while (k < n && d[j + k] == d[i + k] && k < sqz_max_len) {
+                    k++;
+                }
+                if (k >= sqz_min_len && k > lz77_size) {
+                    lz77_size = (uint8_t)k;
+                    lz77_dist = (uint32_t)(i - j);
+                    if (lz77_size == sqz_max_len) break;
+                }
+                if (j == min_j) break;
+                j--;
+            }
+        }
+#endif
+        assert(sqz_max_len < window);
+        size_t best_dist = map_dist;
+        size_t best_size = map_size;
+        uint32_t chain_dist = 0;
+        uint8_t  chain_size = 0;
+        if (depth > 0) {
+            const uint32_t steps = chain_best(&s->chain, d, i, end, window,
+                                              depth, &chain_dist, &chain_size);
+            sqz_count(&s->rc, chain_probes, 1);
+            sqz_count(&s->rc, chain_steps, steps);
+            (void)steps;
+        }
+        if (chain_size > best_size) {
+            best_size = chain_size;
+            best_dist = chain_dist;
+        }
+        // rep match costs a couple of bits and is preferred unless
+        // explicit distance is more than one byte longer:
+        uint8_t  rep_index = 0;
+        uint32_t rep_size  = 0;
+        for (uint8_t r = 0; r < countof(s->rep); r++) {
+            if (s->rep[r] <= i && s->rep[r] < window) {
+                const uint32_t n = sqz_match_len(d, i, end, s->rep[r]);
+                if (n > rep_size) { rep_size = n; rep_index = r + 1; }
+                if (s->rep[r] == best_dist && n == best_size) {
+                    rep_size = n; rep_index = r + 1;
+                    break;
+                }
+            }
+        }
+        if (rep_size >= sqz_min_len && rep_size + 1 >= best_size) {
+            best_size = rep_size;
+            best_dist = s->rep[rep_index - 1];
+        } else {
+            rep_index = 0;
+        }
+//      tree_find_recursive_debug = i == 69;
+//      tree_find(&s->tree, d + i, maximum, &best_size, &best_dist);
+#ifndef SQZ_NO_COMPARE_TO_LZ77
+        if (lz77_size >= sqz_min_len || best_size >= sqz_min_len) {
+            if (lz77_size != best_size || lz77_dist != best_dist) {
+                const uint8_t* match0 = d + i - best_dist;
+                printf("[%zu] %5u:%3d tree `%.*s`\n", i, best_dist, best_size, (int)best_size, match0);
+                swear(memcmp(match0, d + i, best_size) == 0);
+                const uint8_t* match1 = d + i - lz77_dist;
+                printf("[%zu] %5u:%3d lz77 `%.*s\n`", i, lz77_dist, lz77_size, (int)lz77_size, match1);
+                swear(memcmp(match1, d + i, lz77_size) == 0);
+                printf("[%zu] %5u:%3u tree %5u:%3u lz77\n", i,
+                       best_dist, best_size, lz77_dist, lz77_size);
+                pretty_print(s->tree.root, 0);
+                swear(lz77_size == best_size && lz77_dist == best_dist);
+            }
+        }
+#endif
+        // reject back references that take too much compressed space:
+        uint8_t bits = sqz_bits_of((uint32_t)best_dist);
+        if (rep_index == 0 && best_size <= 3 && bits > 3) {
+            best_size = 0;
+            best_dist = 0;
+            if (st != null) { st->rejections++; }
+        }
+//      printf("[%zu] insert('%.*s' %zu)\n", i, (int)(bytes - i), d + i, i);
+        if (best_size >= sqz_min_len) {
+            sqz_match(&s->block, (uint8_t)best_size, rep_index, bits,
+                      (uint32_t)best_dist);
+            if (st != null) {
+                st->size[best_size]++;
+                st->distance_bits[bits]++;
+                if (rep_index > 0) { st->rep_matches++; }
+                st->matched += best_size;
+            }
+            sqz_rep_update(s->rep, rep_index, (uint32_t)best_dist);
+            if (s->map.n > 0) { map_put(s, d + i, (uint32_t)best_size); }
+            size_t next = i + best_size;
+            while (i < next) {
+                if (depth > 0) { chain_insert(&s->chain, d, i, bytes); }
+//              s->tree.root = tree_insert(&s->tree, s->tree.root,
+//                                         d + i, maximum, i);
+                i++;
+                if (i < bytes) {
+//                  size_t start = (i >= window) ? i - window + 1 : 0;
+//                  printf("[%u] tree_evict(start: %u)\n", i, start);
+//                  s->tree.root = tree_evict(&s->tree, s->tree.root, start);
+                }
+            }
+        } else {
+            if (st != null) { st->literals++; }
+            // Otherwise encode literal byte
+            sqz_literal(&s->block, d[i]);
+            if (depth > 0) { chain_insert(&s->chain, d, i, bytes); }
+#if 0 // makes it worse
+            if (s->map.n > 0 && i >= sqz_min_len) {
+                if (i + 1 < bytes) { map_put(s, d + i, 2); }
+                if (i + 2 < bytes) { map_put(s, d + i, 3); }
+                if (i + 3 < bytes) { map_put(s, d + i, 4); }
+            }
+#endif
+//          s->tree.root = tree_insert(&s->tree, s->tree.root,
+//                                     d + i, maximum, i);
+            i++;
+            if (i < bytes) {
+//              size_t start = (i >= window) ? i - window + 1 : 0;
+//              printf("[%u] tree_evict(start: %u)\n", i, start);
+//              s->tree.root = tree_evict(&s->tree, s->tree.root, start);
+            }
+        }
+        if (i == end) {
+            sqz_encode_block(s, d, start, end - start);
+            start = end;
+        }
+    }
+    sqz_put8(s, sqz_end);
+    #ifdef SQZ_INSTRUMENT
+        if (s->rc.counters != null) {
+            struct sqz_counters* c = s->rc.counters;
+            c->ticks[sqz_stage_find] += sqz_ticks() - t0 -
+                (c->ticks[sqz_stage_encode] - encode);
+        }
+    #endif
+}
+
+static size_t sqz_decode_until(struct sqz* s, uint8_t* d, size_t bytes,
+                               size_t need) {
+    // decodes blocks until sqz_end or at least `need` bytes are decoded
+    size_t i = 0;
+    while (s->rc.error == 0 && i < need) {
+        const uint8_t kind = sqz_get8(s);
+        if (s->rc.error != 0 || kind == sqz_end) { break; }
+        const uint64_t t0 = sqz_clock(&s->rc);
+        const uint32_t n = sqz_get32(s);
+        if (s->rc.error != 0) { break; }
+        if (n > sqz_max_block) {
+            s->rc.error = EILSEQ;
+        } else if (kind != sqz_range && kind != sqz_stored &&
+                   n > s->block.capacity) {
+            s->rc.error = ENOBUFS; // context made for smaller blocks
+        } else if (n > bytes - i) {
+            s->rc.error = ENOBUFS;
+        } else if (kind == sqz_range) {
+            sqz_decode_range(s, d, i, i + n);
+        } else if (kind == sqz_stored) {
+            sqz_read_bytes(s, d + i, n);
+        } else if (kind == sqz_huffman || kind == sqz_rans ||
+                   kind == sqz_split) {
+            const uint32_t payload = sqz_get32(s);
+            if (payload > s->block.capacity) {
+                s->rc.error = EILSEQ;
+            } else {
+                sqz_read_bytes(s, s->block.data, payload);
+            }
+            if (s->rc.error == 0 && kind == sqz_huffman) {
+                sqz_decode_huffman(s, d, i, i + n, payload);
+            } else if (s->rc.error == 0 && kind == sqz_rans) {
+                sqz_decode_rans(s, d, i, i + n, payload);
+            } else if (s->rc.error == 0) {
+                sqz_decode_split(s, d, i, i + n, payload);
+            }
+        } else {
+            s->rc.error = EILSEQ;
+        }
+        sqz_timed(&s->rc, sqz_stage_decode, t0);
+        if (s->rc.error == 0) { i += n; }
+    }
+    return i;
+}
+
+uint64_t sqz_decompress(struct sqz* s, void* data, size_t bytes) {
+    return sqz_decode_until(s, (uint8_t*)data, bytes, SIZE_MAX);
+}
+
+// Filters
+
+static void sqz_bcj_x86(uint8_t* d, size_t n, size_t limit, bool encode) {
+    // rel32 of E8/E9 at i is relative to the next instruction at off.
+    // Targets inside the block [0..n) are stored as absolute [0..n),
+    // targets in [n..n + off) as [-off..0), the rest is left as is,
+    // which makes the transform bijective. Scanning does not depend on
+    // converted bytes, so prefix [0..limit) decodes the same as [0..n).
+    const int64_t size = (int64_t)n;
+    size_t i = 0;
+    while (i + 5 <= limit) {
+        if ((d[i] & 0xFE) == 0xE8) {
+            const int64_t off = (int64_t)i + 5;
+            int64_t v = (int32_t)sqz_load32(d + i + 1);
+            if (encode) {
+                if (-off <= v && v < size - off) {
+                    v += off;
+                } else if (size - off <= v && v < size) {
+                    v -= size;
+                }
+            } else {
+                if (0 <= v && v < size) {
+                    v -= off;
+                } else if (-off <= v && v < 0) {
+                    v += size;
+                }
+            }
+            sqz_store32(d + i + 1, (uint32_t)v);
+            i += 5;
+        } else {
+            i++;
+        }
+    }
+}
+
+static void sqz_bcj_arm64(uint8_t* d, size_t limit, bool encode) {
+    // little endian 32-bit instructions, opcode bits are not changed
+    for (size_t i = 0; i + 4 <= limit; i += 4) {
+        uint32_t x = sqz_load32(d + i);
+        if ((x & 0x7C000000u) == 0x14000000u) { // B, BL imm26 words
+            const uint32_t pc = (uint32_t)(i >> 2);
+            uint32_t imm = x & 0x03FFFFFFu;
+            imm = encode ? imm + pc : imm - pc;
+            x = (x & 0xFC000000u) | (imm & 0x03FFFFFFu);
+        } else if ((x & 0x9F000000u) == 0x90000000u) { // ADRP imm21 pages
+            const uint32_t page = (uint32_t)(i >> 12);
+            uint32_t imm = ((x >> 29) & 0x3u) | (((x >> 5) & 0x7FFFFu) << 2);
+            imm = encode ? imm + page : imm - page;
+            x = (x & 0x9F00001Fu) | ((imm & 0x3u) << 29) |
+                (((imm >> 2) & 0x7FFFFu) << 5);
+        }
+        sqz_store32(d + i, x);
+    }
+}
+
+static void sqz_delta(uint8_t* d, size_t n, size_t stride, bool encode) {
+    // per channel difference with the byte `stride` positions back
+    if (encode) {
+        for (size_t i = n; i > stride; i--) {
+            d[i - 1] = (uint8_t)(d[i - 1] - d[i - 1 - stride]);
+        }
+    } else {
+        for (size_t i = stride; i < n; i++) {
+            d[i] = (uint8_t)(d[i] + d[i - stride]);
+        }
+    }
+}
+
+static inline int32_t sqz_abs(int32_t v) { return v < 0 ? -v : v; }
+
+static inline uint8_t sqz_paeth_predict(int32_t a, int32_t b, int32_t c) {
+    // https://www.w3.org/TR/png/#9Filter-type-4-Paeth
+    const int32_t p  = a + b - c;
+    const int32_t pa = sqz_abs(p - a);
+    const int32_t pb = sqz_abs(p - b);
+    const int32_t pc = sqz_abs(p - c);
+    return (uint8_t)(pa <= pb && pa <= pc ? a : (pb <= pc ? b : c));
+}
+
+static inline uint8_t sqz_paeth_at(const uint8_t* d, size_t i,
+                                   size_t stride, size_t row) {
+    // left, up and up-left neighbours, zero outside of the block
+    const int32_t a = i >= stride ? d[i - stride] : 0;
+    const int32_t b = i >= row ? d[i - row] : 0;
+    const int32_t c = i >= row + stride ? d[i - row - stride] : 0;
+    return sqz_paeth_predict(a, b, c);
+}
+
+static void sqz_paeth(uint8_t* d, size_t n, size_t stride, size_t row,
+                      bool encode) {
+    // raster of `row` bytes per scan line and `stride` bytes per pixel,
+    // encoding goes backward so predictions see the original bytes
+    if (encode) {
+        for (size_t i = n; i > 0; i--) {
+            const uint8_t x = sqz_paeth_at(d, i - 1, stride, row);
+            d[i - 1] = (uint8_t)(d[i - 1] - x);
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            d[i] = (uint8_t)(d[i] + sqz_paeth_at(d, i, stride, row));
+        }
+    }
+}
+
+enum { sqz_shuffle_tile = 16 * 1024 };
+
+static size_t sqz_shuffle_tile_bytes(size_t stride) {
+    return sqz_shuffle_tile / stride * stride;
+}
+
+static void sqz_shuffle(uint8_t* d, size_t n, size_t stride, bool encode) {
+    // transposes tiles of `stride` byte elements into byte planes:
+    // byte j of element k goes to [j * count + k]. Trailing bytes of
+    // incomplete element are left as is.
+    uint8_t t[sqz_shuffle_tile];
+    const size_t tile = sqz_shuffle_tile_bytes(stride);
+    for (size_t offset = 0; offset + stride <= n; offset += tile) {
+        const size_t count = (n - offset < tile ? n - offset : tile) / stride;
+        uint8_t* p = d + offset;
+        memcpy(t, p, count * stride);
+        for (size_t j = 0; j < stride; j++) {
+            if (encode) {
+                uint8_t* plane = p + j * count;
+                for (size_t k = 0; k < count; k++) { plane[k] = t[k * stride + j]; }
+            } else {
+                const uint8_t* plane = t + j * count;
+                for (size_t k = 0; k < count; k++) { p[k * stride + j] = plane[k]; }
+            }
+        }
+    }
+}
+
+static size_t sqz_filter_need(const struct sqz_params* p, size_t n, size_t to) {
+    // number of first bytes of the filtered block [0..n) that must be
+    // decoded for the inverse filter to restore bytes [0..to)
+    size_t need = to;
+    if (p->filter == sqz_filter_x86 || p->filter == sqz_filter_arm64) {
+        need = to + 4; // instruction straddling the end of the range
+    } else if (p->filter == sqz_filter_shuffle) {
+        const size_t tile = sqz_shuffle_tile_bytes((size_t)p->stride);
+        need = (to + tile - 1) / tile * tile;
+    }
+    return n - to < need - to ? n : need;
+}
+
+static void sqz_filter_block(const struct sqz_params* p, uint8_t* d, size_t n,
+                             size_t limit, bool encode) {
+    // limit < n filters prefix [0..limit) from sqz_filter_need()
+    const size_t stride = (size_t)p->stride;
+    switch (p->filter) {
+        case sqz_filter_x86    : sqz_bcj_x86(d, n, limit, encode); break;
+        case sqz_filter_arm64  : sqz_bcj_arm64(d, limit, encode); break;
+        case sqz_filter_delta  : sqz_delta(d, limit, stride, encode); break;
+        case sqz_filter_paeth  :
+            sqz_paeth(d, limit, stride, (size_t)p->row, encode);
+            break;
+        case sqz_filter_shuffle: sqz_shuffle(d, limit, stride, encode); break;
+        default: break;
+    }
+}
+
+static void sqz_filter(const struct sqz_params* p, uint8_t* d, size_t bytes,
+                       bool encode) {
+    const size_t block = (size_t)1 << p->block_bits;
+    for (size_t offset = 0; offset < bytes; offset += block) {
+        const size_t n = bytes - offset < block ? bytes - offset : block;
+        sqz_filter_block(p, d + offset, n, n, encode);
+    }
+}
+
+void sqz_filter_encode(const struct sqz_params* p, void* data, size_t bytes) {
+    sqz_filter(p, (uint8_t*)data, bytes, true);
+}
+
+void sqz_filter_decode(const struct sqz_params* p, void* data, size_t bytes) {
+    sqz_filter(p, (uint8_t*)data, bytes, false);
+}
+
+// Analysis
+
+// sqz_analyze() looks at up to sqz_analyze_chunks evenly spaced chunks
+// covering 1/64 of the source, so that its cost stays within couple
+// percent of sqz_frame_compress() time. Incompressible and trivially
+// compressible samples are recognized by order-0 entropy first.
+
+enum {
+    sqz_analyze_chunk  = 1024,
+    sqz_analyze_chunks = 16,
+    sqz_analyze_stride = 16  // delta and shuffle stride candidates 1..16
+};
+
+struct sqz_analysis {
+    uint32_t freq[256];                          // order-0
+    uint32_t delta[sqz_analyze_stride + 1][256]; // d[i] - d[i - stride]
+    uint32_t deltas[sqz_analyze_stride + 1];
+    uint32_t n;
+    uint32_t calls;    // E8/E9 with near rel32 target
+    uint32_t branches; // BL with near imm26 target
+    uint32_t words;    // aligned 32-bit words
+    uint32_t invalid;  // invalid UTF-8 and control bytes
+};
+
+static void sqz_analyze_utf8(struct sqz_analysis* a,
+                             const uint8_t* d, size_t bytes) {
+    size_t i = 0;
+    while (i < bytes && (d[i] & 0xC0) == 0x80) { i++; } // mid sequence
+    while (i < bytes) {
+        const uint8_t b = d[i];
+        const size_t k = b < 0x80 ? 1 : (b & 0xE0) == 0xC0 ? 2 :
+                         (b & 0xF0) == 0xE0 ? 3 : (b & 0xF8) == 0xF0 ? 4 : 0;
+        if (k == 0 || (b < 0x20 && b != '\t' && b != '\n' && b != '\r')) {
+            a->invalid++;
+            i++;
+        } else {
+            size_t j = 1;
+            while (j < k && i + j < bytes && (d[i + j] & 0xC0) == 0x80) { j++; }
+            if (j < k && i + j < bytes) { a->invalid++; }
+            i += j;
+        }
+    }
+}
+
+static void sqz_analyze_chunk_at(struct sqz_analysis* a, const uint8_t* d,
+                                 size_t bytes, size_t offset) {
+    // offset of the chunk in the source aligns ARM64 instructions
+    for (size_t i = 1; i < bytes; i++) {
+        const size_t m = i < sqz_analyze_stride ? i : sqz_analyze_stride;
+        for (size_t k = 1; k <= m; k++) {
+            a->delta[k][(uint8_t)(d[i] - d[i - k])]++;
+        }
+    }
+    for (size_t k = 1; k <= sqz_analyze_stride && k < bytes; k++) {
+        a->deltas[k] += (uint32_t)(bytes - k);
+    }
+    for (size_t i = 0; i + 5 <= bytes; i++) {
+        if ((d[i] & 0xFE) == 0xE8 && (d[i + 4] == 0x00 || d[i + 4] == 0xFF)) {
+            a->calls++;
+        }
+    }
+    for (size_t i = (4 - offset % 4) % 4; i + 4 <= bytes; i += 4) {
+        const uint32_t x = sqz_load32(d + i);
+        const uint32_t top = (x >> 20) & 0x3Fu; // imm26 bits 25..20
+        if ((x & 0xFC000000u) == 0x94000000u && (top == 0 || top == 0x3F)) {
+            a->branches++;
+        }
+        a->words++;
+    }
+    sqz_analyze_utf8(a, d, bytes);
+}
+
+static bool sqz_analyze_header(const uint8_t* d, size_t bytes,
+                               struct sqz_params* p) {
+    // executables and uncompressed BMP rasters are recognized by headers
+    if (bytes >= 20 && memcmp(d, "\x7F" "ELF", 4) == 0) {
+        const uint32_t machine = d[18] | ((uint32_t)d[19] << 8);
+        if (machine == 0x03 || machine == 0x3E) { p->filter = sqz_filter_x86; }
+        if (machine == 0xB7) { p->filter = sqz_filter_arm64; }
+    } else if (bytes >= 0x40 && d[0] == 'M' && d[1] == 'Z') {
+        const size_t pe = sqz_load32(d + 0x3C);
+        if (pe < bytes - 6 && memcmp(d + pe, "PE\0\0", 4) == 0) {
+            const uint32_t machine = d[pe + 4] | ((uint32_t)d[pe + 5] << 8);
+            if (machine == 0x014C || machine == 0x8664) {
+                p->filter = sqz_filter_x86;
+            }
+            if (machine == 0xAA64) { p->filter = sqz_filter_arm64; }
+        }
+    } else if (bytes >= 34 && d[0] == 'B' && d[1] == 'M' &&
+               sqz_load32(d + 14) >= 40) {
+        const int32_t  width = (int32_t)sqz_load32(d + 18);
+        const uint32_t bpp   = d[28] | ((uint32_t)d[29] << 8);
+        const uint32_t kind  = sqz_load32(d + 30); // 0: BI_RGB 3: BITFIELDS
+        if ((bpp == 24 || bpp == 32) && (kind == 0 || kind == 3) &&
+            0 < width && width <= (INT32_MAX - 31) / 32) {
+            p->filter = sqz_filter_paeth;
+            p->stride = (int32_t)bpp / 8;
+            p->row    = (width * (int32_t)bpp + 31) / 32 * 4;
+        }
+    }
+    return p->filter != sqz_filter_none;
+}
+
+static void sqz_analyze_sample(struct sqz_analysis* a, struct sqz_params* p) {
+    // near calls are about 1% of x86 code bytes and BL about 5% of
+    // ARM64 instructions, in random data both are below 0.05%
+    if (a->invalid * 100u < a->n) { // UTF-8 text
+    } else if (a->calls * 200u > a->n) {
+        p->filter = sqz_filter_x86;
+    } else if (a->branches * 50u > a->words) {
+        p->filter = sqz_filter_arm64;
+    } else {
+        // fixed size elements: bytes `stride` apart are correlated,
+        // filter is worth it if it saves at least a bit per byte
+        double best = sqz_sample_entropy(a->freq, a->n) - 1.0;
+        for (int32_t k = 1; k <= sqz_analyze_stride; k++) {
+            const double e = sqz_sample_entropy(a->delta[k], a->deltas[k]);
+            if (e < best - 0.05) {
+                best = e;
+                p->filter = sqz_filter_delta;
+                p->stride = k;
+            }
+        }
+        if (p->filter == sqz_filter_delta && p->stride > 1) {
+            // many equal and otherwise unrelated bytes (constant high
+            // bytes, noisy low bytes of numbers): byte planes give LZ
+            // long runs while delta would interleave them with noise
+            uint32_t* h = a->delta[p->stride];
+            const uint32_t equal = h[0];
+            const uint32_t n = a->deltas[p->stride];
+            h[0] = 0;
+            if (equal * 4u > n && sqz_sample_entropy(h, n - equal) > 6.0) {
+                p->filter = sqz_filter_shuffle;
+            }
+        }
+    }
+}
+
+void sqz_analyze(const void* data, size_t bytes, struct sqz_params* p) {
+    const uint8_t* d = (const uint8_t*)data;
+    p->backend = sqz_auto;
+    p->level   = sqz_auto;
+    p->filter  = sqz_filter_none;
+    p->stride  = 1;
+    p->row     = 0;
+    if (bytes > 0 && !sqz_analyze_header(d, bytes, p)) {
+        struct sqz_analysis a;
+        memset(&a, 0, sizeof(a));
+        size_t chunks = bytes / 64 / sqz_analyze_chunk;
+        if (chunks > sqz_analyze_chunks) { chunks = sqz_analyze_chunks; }
+        if (chunks == 0) { chunks = 1; }
+        const size_t step = bytes / chunks;
+        const size_t n = bytes < sqz_analyze_chunk ? bytes : sqz_analyze_chunk;
+        for (size_t k = 0; k < chunks; k++) {
+            const uint8_t* c = d + k * step;
+            for (size_t i = 0; i < n; i++) { a.freq[c[i]]++; }
+        }
+        a.n = (uint32_t)(chunks * n);
+        const double e = sqz_sample_entropy(a.freq, a.n);
+        if (1.0 < e && e <= 7.95) {
+            for (size_t k = 0; k < chunks; k++) {
+                sqz_analyze_chunk_at(&a, d + k * step, n, k * step);
+            }
+            sqz_analyze_sample(&a, p);
+        }
+    }
+}
+
+// Frame
+
+static const uint8_t sqz_frame_magic[4] = { 's', 'q', 'z', 'F' };
+
+static inline void sqz_store64(uint8_t* p, uint64_t v) {
+    sqz_store32(p, (uint32_t)v);
+    sqz_store32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint64_t sqz_load64(const uint8_t* p) {
+    return sqz_load32(p) | ((uint64_t)sqz_load32(p + 4) << 32);
+}
+
+// xxHash64 https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+// with seed 0, same as checksum64() in rt/fileio.h
+
+static const uint64_t sqz_p1 = 0x9E3779B185EBCA87uLL;
+static const uint64_t sqz_p2 = 0xC2B2AE3D27D4EB4FuLL;
+static const uint64_t sqz_p3 = 0x165667B19E3779F9uLL;
+static const uint64_t sqz_p4 = 0x85EBCA77C2B2AE63uLL;
+static const uint64_t sqz_p5 = 0x27D4EB2F165667C5uLL;
+
+static inline uint64_t sqz_rotl(uint64_t v, int32_t n) {
+    return (v << n) | (v >> (64 - n));
+}
+
+static inline uint64_t sqz_round(uint64_t lane, uint64_t v) {
+    lane += v * sqz_p2;
+    return sqz_rotl(lane, 31) * sqz_p1;
+}
+
+static uint64_t sqz_checksum(const uint8_t* d, size_t bytes) {
+    const uint8_t* p = d;
+    const uint8_t* end = d + bytes;
+    uint64_t h = 0;
+    if (bytes >= 32) { // 4 independent lanes
+        uint64_t v[4] = { sqz_p1 + sqz_p2, sqz_p2, 0, 0 - sqz_p1 };
+        while (end - p >= 32) {
+            for (int i = 0; i < 4; i++) {
+                v[i] = sqz_round(v[i], sqz_load64(p + i * 8));
+            }
+            p += 32;
+        }
+        h = sqz_rotl(v[0], 1) + sqz_rotl(v[1], 7) +
+            sqz_rotl(v[2], 12) + sqz_rotl(v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h ^= sqz_round(0, v[i]);
+            h = h * sqz_p1 + sqz_p4;
+        }
+    } else {
+        h = sqz_p5;
+    }
+    h += bytes;
+    while (end - p >= 8) {
+        h ^= sqz_round(0, sqz_load64(p));
+        h = sqz_rotl(h, 27) * sqz_p1 + sqz_p4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        h ^= (uint64_t)sqz_load32(p) * sqz_p1;
+        h = sqz_rotl(h, 23) * sqz_p2 + sqz_p3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= *p++ * sqz_p5;
+        h = sqz_rotl(h, 11) * sqz_p1;
+    }
+    h ^= h >> 33; h *= sqz_p2;
+    h ^= h >> 29; h *= sqz_p3;
+    h ^= h >> 32;
+    return h;
+}
+
+void sqz_params_init(struct sqz_params* p) {
+    p->window_bits = sqz_chain_win_bits;
+    p->level       = sqz_default_level;
+    p->block_bits  = 20;
+    p->backend     = sqz_range;
+    p->filter      = sqz_filter_none;
+    p->stride      = 1;
+    p->row         = 0;
+}
+
+static bool sqz_params_valid(const struct sqz_params* p) {
+    return sqz_min_win_bits <= p->window_bits &&
+           p->window_bits <= sqz_chain_win_bits &&
+           (p->level == sqz_auto ||
+            (0 <= p->level && p->level <= sqz_max_level)) &&
+           sqz_frame_min_block_bits <= p->block_bits &&
+           p->block_bits <= sqz_frame_max_block_bits &&
+           (p->backend == sqz_auto ||
+            (sqz_range <= p->backend && p->backend <= sqz_split)) &&
+           sqz_filter_none <= p->filter && p->filter <= sqz_filter_shuffle &&
+           1 <= p->stride && p->stride <= sqz_max_stride && 0 <= p->row &&
+           (p->filter != sqz_filter_paeth || p->stride <= p->row);
+}
+
+static uint64_t sqz_frame_blocks(uint64_t bytes, int32_t block_bits) {
+    // rounded up without overflow of bytes + block - 1
+    const uint64_t mask = (1uLL << block_bits) - 1;
+    return (bytes >> block_bits) + ((bytes & mask) != 0);
+}
+
+size_t sqz_frame_bound(const struct sqz_params* p, size_t bytes) {
+    // incompressible blocks are stored as is
+    return sqz_frame_header +
+           (size_t)sqz_frame_blocks(bytes, p->block_bits) * sqz_frame_entry +
+           bytes;
+}
+
+static void sqz_auto_block(struct sqz* s, const struct sqz_params* p,
+                           double entropy) {
+    // Above 7 bits per byte matches are rare and short and deep hash
+    // chains are wasted effort, but adaptive range coding still earns
+    // its cost: unfiltered mandrill.bmp is 93.20% with range coding at
+    // level 2 and 96.19% with static Huffman. Blocks that would not
+    // gain are stored by sqz_frame_compress() before they get here.
+    const bool dense = entropy > 7.0;
+    s->backend = p->backend != sqz_auto ? p->backend : sqz_range;
+    s->level   = p->level != sqz_auto ? p->level :
+                 (dense ? 2 : sqz_default_level);
+}
+
+size_t sqz_frame_compress(struct sqz* s, const struct sqz_params* p,
+                          const void* data, size_t bytes,
+                          void* frame, size_t capacity) {
+    const uint8_t* d = (const uint8_t*)data;
+    uint8_t* f = (uint8_t*)frame;
+    s->rc.error = 0;
+    if (!sqz_params_valid(p)) { s->rc.error = EINVAL; return 0; }
+    const uint64_t blocks = sqz_frame_blocks(bytes, p->block_bits);
+    if (blocks > UINT32_MAX) { s->rc.error = E2BIG; return 0; }
+    const size_t block = (size_t)1 << p->block_bits;
+    size_t pos = sqz_frame_header + (size_t)blocks * sqz_frame_entry;
+    if (capacity < pos) { s->rc.error = E2BIG; return 0; }
+    memcpy(f, sqz_frame_magic, sizeof(sqz_frame_magic));
+    f[4] = sqz_frame_version;
+    f[5] = (uint8_t)p->window_bits;
+    f[6] = (uint8_t)p->level;
+    f[7] = (uint8_t)p->block_bits;
+    f[8] = (uint8_t)p->backend;
+    f[9] = (uint8_t)p->filter;
+    f[10] = (uint8_t)p->stride;
+    f[11] = 0;
+    sqz_store64(f + 12, bytes);
+    sqz_store32(f + 20, (uint32_t)blocks);
+    sqz_store32(f + 24, (uint32_t)p->row);
+    struct sqz_trace* tr = s->trace;
+    for (size_t k = 0; k < blocks && s->rc.error == 0; k++) {
+        const size_t offset = k * block;
+        const size_t n = bytes - offset < block ? bytes - offset : block;
+        if (tr != null) { tr->block = (uint32_t)k; }
+        // block larger than source is not worth it:
+        struct sqz_memory m = { f + pos, 0, 0 };
+        m.capacity = capacity - pos < n ? capacity - pos : n;
+        const double entropy = sqz_block_entropy(d + offset, n);
+        const bool incompressible = n >= sqz_sample_min && entropy > 7.95;
+        if (!incompressible) {
+            sqz_reset(s);
+            sqz_auto_block(s, p, entropy);
+            s->that = &m;
+            s->rc.write = sqz_memory_write;
+            sqz_compress(s, d + offset, n, 1u << p->window_bits);
+        }
+        uint32_t size = (uint32_t)m.bytes;
+        if ((incompressible || s->rc.error == E2BIG) && n > capacity - pos) {
+            s->rc.error = E2BIG; // cannot be stored either
+        } else if (incompressible || s->rc.error == E2BIG) {
+            const uint64_t t0 = tr != null ? sqz_trace_time() : 0;
+            s->rc.error = 0;
+            memcpy(f + pos, d + offset, n);
+            m.bytes = n;
+            size = (uint32_t)n | (1u << sqz_frame_stored_bit);
+            if (tr != null) { sqz_trace_add(tr, sqz_phase_store, t0, n, n); }
+        }
+        uint8_t* e = f + sqz_frame_header + k * sqz_frame_entry;
+        sqz_store32(e, size);
+        const uint64_t t1 = tr != null ? sqz_trace_time() : 0;
+        sqz_store64(e + 4, sqz_checksum(d + offset, n));
+        if (tr != null) { sqz_trace_add(tr, sqz_phase_checksum, t1, n, 0); }
+        pos += m.bytes;
+    }
+    return s->rc.error == 0 ? pos : 0;
+}
+
+int32_t sqz_frame_info(const void* frame, size_t bytes,
+                       struct sqz_frame_info* info) {
+    const uint8_t* f = (const uint8_t*)frame;
+    if (bytes < sqz_frame_header) { return EINVAL; }
+    if (memcmp(f, sqz_frame_magic, sizeof(sqz_frame_magic)) != 0) {
+        return EILSEQ;
+    }
+    if (f[4] != sqz_frame_version) { return ENOSYS; }
+    info->params.window_bits = f[5];
+    info->params.level       = f[6] == 0xFF ? sqz_auto : f[6];
+    info->params.block_bits  = f[7];
+    info->params.backend     = f[8] == 0xFF ? sqz_auto : f[8];
+    info->params.filter      = f[9];
+    info->params.stride      = f[10];
+    const uint32_t row = sqz_load32(f + 24);
+    info->params.row         = row <= INT32_MAX ? (int32_t)row : -1;
+    info->bytes  = sqz_load64(f + 12);
+    info->blocks = sqz_load32(f + 20);
+    if (!sqz_params_valid(&info->params)) { return EINVAL; }
+    // every block but the last one is full and the last one is not empty:
+    const int32_t bb = info->params.block_bits;
+    const uint64_t blocks = info->blocks;
+    if (info->bytes > (blocks << bb) ||
+        (blocks > 0 && info->bytes <= ((blocks - 1) << bb)) ||
+        info->bytes > SIZE_MAX) {
+        return EINVAL;
+    }
+    const uint64_t table = sqz_frame_header + blocks * sqz_frame_entry;
+    if (table > bytes) { return EINVAL; }
+    uint64_t total = table;
+    for (uint32_t k = 0; k < info->blocks; k++) {
+        const uint32_t size = sqz_load32(f + sqz_frame_header +
+                                         k * sqz_frame_entry);
+        total += size & ~(1u << sqz_frame_stored_bit);
+    }
+    return total <= bytes ? 0 : EINVAL;
+}
+
+static void sqz_frame_decode_block(struct sqz* s, const uint8_t* entry,
+                                   const uint8_t* block,
+                                   uint8_t* d, size_t n, size_t need) {
+    // decodes at least `need` first bytes of the block into d[n],
+    // checksum can be verified only if whole block is decoded
+    const uint32_t size = sqz_load32(entry) & ~(1u << sqz_frame_stored_bit);
+    const bool stored = (sqz_load32(entry) >> sqz_frame_stored_bit) != 0;
+    struct sqz_trace* tr = s->trace;
+    const uint64_t t0 = tr != null ? sqz_trace_time() : 0;
+    if (stored) {
+        if (size == n) {
+            memcpy(d, block, need);
+        } else {
+            s->rc.error = EILSEQ;
+        }
+    } else {
+        struct sqz_memory m = { (uint8_t*)block, size, 0 };
+        sqz_reset(s);
+        s->that = &m;
+        s->rc.read = sqz_memory_read;
+        const size_t k = sqz_decode_until(s, d, n, need < n ? need : SIZE_MAX);
+        if (s->rc.error == 0 && (k < need || (need == n && k != n))) {
+            s->rc.error = EILSEQ;
+        }
+    }
+    if (tr != null) { sqz_trace_add(tr, sqz_phase_decode, t0, size, need); }
+    if (s->rc.error == 0 && need == n) {
+        const uint64_t t1 = tr != null ? sqz_trace_time() : 0;
+        if (sqz_checksum(d, n) != sqz_load64(entry + 4)) {
+            s->rc.error = EILSEQ;
+        }
+        if (tr != null) { sqz_trace_add(tr, sqz_phase_checksum, t1, n, 0); }
+    }
+}
+
+static void sqz_frame_filter(struct sqz* s, const struct sqz_params* p,
+                             uint8_t* d, size_t n, size_t limit) {
+    // decodes filter of the block [0..limit) in place
+    if (p->filter != sqz_filter_none) {
+        const uint64_t t0 = sqz_clock(&s->rc);
+        const uint64_t t1 = s->trace != null ? sqz_trace_time() : 0;
+        sqz_filter_block(p, d, n, limit, false);
+        sqz_timed(&s->rc, sqz_stage_filter, t0);
+        if (s->trace != null) {
+            sqz_trace_add(s->trace, sqz_phase_filter, t1, limit, limit);
+        }
+    }
+}
+
+size_t sqz_frame_decompress(struct sqz* s, const void* frame, size_t bytes,
+                            void* data, size_t capacity) {
+    const uint8_t* f = (const uint8_t*)frame;
+    uint8_t* d = (uint8_t*)data;
+    struct sqz_frame_info info = {0};
+    s->rc.error = sqz_frame_info(frame, bytes, &info);
+    if (s->rc.error == 0 && info.bytes > capacity) { s->rc.error = ENOBUFS; }
+    if (s->rc.error != 0) { return 0; }
+    const size_t block = (size_t)1 << info.params.block_bits;
+    size_t pos = sqz_frame_header + (size_t)info.blocks * sqz_frame_entry;
+    for (uint32_t k = 0; k < info.blocks && s->rc.error == 0; k++) {
+        const uint8_t* e = f + sqz_frame_header + k * sqz_frame_entry;
+        const size_t offset = k * block;
+        const size_t n = (size_t)info.bytes - offset < block ?
+                         (size_t)info.bytes - offset : block;
+        if (s->trace != null) { s->trace->block = k; }
+        sqz_frame_decode_block(s, e, f + pos, d + offset, n, n);
+        if (s->rc.error == 0) {
+            sqz_frame_filter(s, &info.params, d + offset, n, n);
+        }
+        pos += sqz_load32(e) & ~(1u << sqz_frame_stored_bit);
+    }
+    return s->rc.error == 0 ? (size_t)info.bytes : 0;
+}
+
+size_t sqz_decompress_range(struct sqz* s, const void* frame, size_t bytes,
+                            uint64_t offset, size_t length,
+                            void* data, void* scratch) {
+    const uint8_t* f = (const uint8_t*)frame;
+    uint8_t* d = (uint8_t*)data;
+    struct sqz_frame_info info = {0};
+    s->rc.error = sqz_frame_info(frame, bytes, &info);
+    if (s->rc.error == 0 && offset > info.bytes) { s->rc.error = ERANGE; }
+    if (s->rc.error != 0) { return 0; }
+    if (length > info.bytes - offset) { length = (size_t)(info.bytes - offset); }
+    if (length == 0) { return 0; }
+    const int32_t bits = info.params.block_bits;
+    const size_t  block = (size_t)1 << bits;
+    const uint64_t end = offset + length;
+    const uint32_t first = (uint32_t)(offset >> bits);
+    const uint32_t last  = (uint32_t)((end - 1) >> bits);
+    size_t pos = sqz_frame_header + (size_t)info.blocks * sqz_frame_entry;
+    for (uint32_t k = 0; k < first; k++) {
+        pos += sqz_load32(f + sqz_frame_header + k * sqz_frame_entry) &
+               ~(1u << sqz_frame_stored_bit);
+    }
+    for (uint32_t k = first; k <= last && s->rc.error == 0; k++) {
+        const uint8_t* e = f + sqz_frame_header + k * sqz_frame_entry;
+        const uint64_t start = (uint64_t)k << bits;
+        const size_t n = info.bytes - start < block ?
+                         (size_t)(info.bytes - start) : block;
+        const size_t from = offset > start ? (size_t)(offset - start) : 0;
+        const size_t to   = end - start < n ? (size_t)(end - start) : n;
+        uint8_t* out = d + (size_t)(start + from - offset);
+        if (from == 0 && to == n) {
+            sqz_frame_decode_block(s, e, f + pos, out, n, n);
+            if (s->rc.error == 0) {
+                sqz_frame_filter(s, &info.params, out, n, n);
+            }
+        } else if (scratch == null) {
+            s->rc.error = EINVAL;
+        } else {
+            const size_t need = sqz_filter_need(&info.params, n, to);
+            sqz_frame_decode_block(s, e, f + pos, (uint8_t*)scratch, n, need);
+            if (s->rc.error == 0) {
+                sqz_frame_filter(s, &info.params, (uint8_t*)scratch, n, need);
+                memcpy(out, (uint8_t*)scratch + from, to - from);
+            }
+        }
+        pos += sqz_load32(e) & ~(1u << sqz_frame_stored_bit);
+    }
+    return s->rc.error == 0 ? length : 0;
 }
@@ -3,6 +3,14 @@
 #include "sqz/sqz.h"
 #include "rt/rt_generics_test.h"
 
+#ifdef _WIN32 // stdout redirection of test_quiet_stats()
+#include <io.h>
+#define dup   _dup
+#define dup2  _dup2
+#define close _close
+#define fileno _fileno
+#endif
+
 #undef  SQUEEZE_MAX_WINDOW
 #define SQUEEZE_MAX_WINDOW
 
@@ -21,7 +29,7 @@ enum { window_bits = 11 }; // 2KB
 
 // Test is limited to "size_t" and "int" precision
 
-static double entropy(uint64_t* freq, size_t n) { // Shannon entropy
+static double entropy(const uint64_t* freq, size_t n) { // Shannon entropy
     double total = 0;
     for (size_t i = 0; i < n; i++) {
         if (freq[i] > 1) {
@@ -38,155 +46,226 @@ static double entropy(uint64_t* freq, size_t n) { // Shannon entropy
     return e;
 }
 
-static uint8_t squeeze_id[8] = { 's', 'q', 'u', 'e', 'e', 'z', 'e', '4' };
-
-static void write_header(struct io* io, uint64_t bytes) {
-    io_write(io, squeeze_id, sizeof(squeeze_id));
-    io_put64(io, bytes);
+static void print_stats(const struct sqz_stats* st) {
+    const double bytes = (double)(st->literals + st->matched);
+    printf("literals: %.2f%% back references: %.2f%%\n",
+           bytes > 0 ? 100.0 * st->literals / bytes : 0,
+           bytes > 0 ? 100.0 * st->matched / bytes : 0);
+    printf("entropies: size: %.2f distance bits: %.2f\n",
+           entropy(st->size, countof(st->size)),
+           entropy(st->distance_bits, countof(st->distance_bits)));
+    printf("rejections: %lld rep matches: %lld\n",
+           st->rejections, st->rep_matches);
+    double total = 0;
+    double cumulative = 0;
+    for (int j = 0; j < countof(st->distance_bits); j++) {
+        total += (double)st->distance_bits[j];
+    }
+    for (int j = 0; j < countof(st->distance_bits); j++) {
+        if (st->distance_bits[j] > 0) {
+            double p = (100.0 * st->distance_bits[j]) / total;
+            cumulative += p;
+            printf("distance_bits[%2d]: %7.3f%% %7.3f%%\n", j, p, cumulative);
+        }
+    }
 }
 
-static void put(struct range_coder* rc, uint8_t b) {
-    struct sqz* s = (struct sqz*)rc;
-    struct io* io = s->that;
-    if (rc->error == 0) {
-        io_put(io, b);
-        rc->error = io->error;
+#ifdef SQZ_INSTRUMENT
+
+static void print_counters(const struct sqz_counters* c) {
+    static const char* model[sqz_models] = {
+        "run", "size", "byte", "bits", "dist", "rep"
+    };
+    static const char* stage[sqz_stages] = {
+        "find", "encode", "decode", "filter"
+    };
+    printf("chain probes: %lld steps: %lld map probes: %lld steps: %lld\n",
+           c->chain_probes, c->chain_steps, c->map_probes, c->map_steps);
+    printf("rc_encode:");
+    for (int i = 0; i < sqz_models; i++) {
+        printf(" %s: %lld", model[i], c->encodes[i]);
+    }
+    printf("\nemits: %lld written: %lld ticks:", c->emits, c->written);
+    for (int i = 0; i < sqz_stages; i++) {
+        printf(" %s: %lld", stage[i], c->ticks[i]);
     }
+    printf("\n");
 }
 
+#endif
+
 static errno_t compress(const char* from, const char* to,
-                        const uint8_t* data, size_t bytes) {
+                        const uint8_t* data, size_t bytes, int32_t backend) {
+    struct sqz_params params;
+    sqz_params_init(&params);
+    params.window_bits = window_bits;
+    params.backend = backend;
+    struct io memory = {0}; // encoder context
+    io_alloc(&memory, sqz_sizeof(&params));
+    if (memory.error != 0) {
+        printf("Failed to allocate memory for encoder\n");
+        return memory.error;
+    }
+    struct sqz* encoder = sqz_init_with(memory.data, memory.capacity, &params);
+    swear(encoder != null);
+    struct sqz_stats stats = {0};
+    encoder->stats = &stats;
+    #ifdef SQZ_INSTRUMENT
+        struct sqz_counters counters = {0};
+        encoder->rc.counters = &counters;
+    #endif
+    struct io frame = {0}; // compressed in memory
+    io_alloc(&frame, sqz_frame_bound(&params, bytes));
+    if (frame.error != 0) {
+        printf("Failed to allocate memory for compressed data\n");
+        io_close(&memory);
+        return frame.error;
+    }
+    frame.written = sqz_frame_compress(encoder, &params, data, bytes,
+                                       frame.data, frame.capacity);
+    if (encoder->rc.error != 0) {
+        printf("Failed to compress: %s\n", strerror(encoder->rc.error));
+    }
+    swear(encoder->rc.error == 0);
     struct io out = {0}; // compressed file
-    io_create(&out, to);
-    if (out.error != 0) {
-        printf("Failed to create \"%s\": %s\n", to, strerror(out.error));
-        return out.error;
-    }
-    static struct sqz encoder; // static for testing, can be heap malloc()-ed
-    static struct map_entry me[32 * 1024 * 1024];
-    encoder.that = &out;
-    encoder.rc.write = put;
-    sqz_init(&encoder, me, sizeof(me) / sizeof(me[0]));
-//  encoder.map.n = 0;
-    write_header(&out, bytes);
-    if (encoder.rc.error != 0) {
-        printf("io_create(\"%s\") failed: %s\n", to, strerror(encoder.rc.error));
-    } else {
-        sqz_compress(&encoder, data, bytes, 1u << window_bits);
-        if (encoder.rc.error != 0) {
-            printf("Failed to compress: %s\n", strerror(encoder.rc.error));
+    if (encoder->rc.error == 0) {
+        io_create(&out, to);
+        if (out.error != 0) {
+            printf("Failed to create \"%s\": %s\n", to, strerror(out.error));
+            encoder->rc.error = out.error;
         }
-        swear(encoder.rc.error == 0);
     }
-    io_close(&out); // error flushing buffered output
-    if (encoder.rc.error == 0 && out.error != 0) {
-        printf("io_close(\"%s\") failed: %s\n", to, strerror(out.error));
-        encoder.rc.error = out.error;
+    if (encoder->rc.error == 0) {
+        io_write(&out, frame.data, (size_t)frame.written);
+        io_close(&out); // error flushing buffered output
+        if (out.error != 0) {
+            printf("Failed to write \"%s\": %s\n", to, strerror(out.error));
+            encoder->rc.error = out.error;
+        }
     }
-    if (encoder.rc.error == 0) {
+    if (encoder->rc.error == 0) {
         char* fn = from == null ? null : strrchr(from, '\\'); // basename
         if (fn == null) { fn = from == null ? null : strrchr(from, '/'); }
         if (fn != null) { fn++; } else { fn = (char*)from; }
-        double pc  = out.written * 100.0 / bytes; // percent
-        double bps = out.written * 8.0   / bytes; // bits per symbol
+        print_stats(&stats);
+        #ifdef SQZ_INSTRUMENT
+            print_counters(&counters);
+        #endif
+        double pc  = frame.written * 100.0 / bytes; // percent
+        double bps = frame.written * 8.0   / bytes; // bits per symbol
         printf("bps: %4.1f ", bps);
         if (from != null) {
             printf("%7lld -> %7lld %6.2f%% of \"%s\"\n\n",
-                  (uint64_t)bytes, out.written, pc, fn);
+                  (uint64_t)bytes, frame.written, pc, fn);
         } else {
             printf("%7lld -> %7lld %6.2f%%\n\n",
-                  (uint64_t)bytes, out.written, pc);
+                  (uint64_t)bytes, frame.written, pc);
         }
     }
-    return encoder.rc.error;
-}
-
-static void read_header(struct io* io, uint64_t *bytes) {
-    uint8_t id[8] = {0};
-    io_read(io, id, sizeof(id));
-    *bytes = io_get64(io);
-    if (io->error == 0 && memcmp(id, squeeze_id, sizeof(id)) != 0) {
-        io->error = EILSEQ;
-    }
-}
-
-static uint8_t get(struct range_coder* rc) {
-    struct sqz* s = (struct sqz*)rc;
-    struct io* io = s->that;
-    uint8_t b = 0;
-    if (rc->error == 0) {
-        b = io_get(io);
-        rc->error = io->error;
-    }
-    return b;
+    io_close(&frame);
+    const errno_t r = encoder->rc.error;
+    io_close(&memory);
+    return r;
 }
 
 static errno_t verify(const char* fn, const uint8_t* input, size_t size) {
     // decompress and compare
     struct io in = {0}; // compressed file
-    io_open(&in, fn);
+    io_read_fully(&in, fn);
     if (in.error != 0) {
-        printf("Failed to open \"%s\"\n", fn);
+        printf("Failed to read \"%s\"\n", fn);
         return in.error;
     }
-    uint64_t bytes = 0;
-    static struct sqz decoder; // static to avoid >64KB stack warning
-    sqz_init(&decoder, null, 0);
-    decoder.that = &in;
-    decoder.rc.read = get;
-    read_header(&in, &bytes);
-    if (in.error != 0) {
-        printf("Failed to read header from \"%s\"\n", fn);
-        io_close(&in); // was opened for reading, close will not fail
-        decoder.rc.error = in.error;
-    } else if (bytes > SIZE_MAX) {
+    struct sqz_frame_info info = {0};
+    errno_t r = sqz_frame_info(in.data, in.capacity, &info);
+    if (r != 0) {
+        printf("Failed to read frame header from \"%s\"\n", fn);
+    } else if (info.bytes > SIZE_MAX) {
         printf("File too large to decompress\n");
-        decoder.rc.error = EFBIG;
+        r = EFBIG;
     }
-    struct io out = {0}; // decompressed file
-    if (decoder.rc.error == 0) {
-        io_alloc(&out, (size_t)bytes);
-        if (out.error != 0) {
-            printf("Failed to allocate memory of %lld bytes"
-                   " for decompressed data\n", bytes);
-            decoder.rc.error = out.error;
+    struct io memory = {0}; // decoder context
+    struct sqz* decoder = null;
+    if (r == 0) {
+        info.params.level = 0; // decoder needs no match finder
+        io_alloc(&memory, sqz_sizeof(&info.params));
+        r = memory.error;
+        if (r == 0) {
+            decoder = sqz_init_with(memory.data, memory.capacity,
+                                    &info.params);
+            swear(decoder != null);
         }
-        if (out.error == 0 && bytes > size) { out.error = E2BIG; }
+    }
+    struct io out = {0}; // decompressed data
+    if (r == 0) {
+        io_alloc(&out, (size_t)info.bytes);
         if (out.error != 0) {
-            decoder.rc.error = out.error;
+            printf("Failed to allocate memory of %lld bytes"
+                   " for decompressed data\n", info.bytes);
+            r = out.error;
+        } else if (info.bytes > size) {
+            r = E2BIG;
         }
     }
-    if (decoder.rc.error == 0) {
-        swear(bytes == size);
-        sqz_decompress(&decoder, out.data, (size_t)bytes);
-        if (decoder.rc.error == 0) {
-            const bool same = size == bytes &&
-                       memcmp(input, out.data, (size_t)bytes) == 0;
+    if (r == 0) {
+        swear(info.bytes == size);
+        sqz_frame_decompress(decoder, in.data, in.capacity,
+                             out.data, out.capacity);
+        r = decoder->rc.error;
+        if (r != 0) {
+            printf("Failed to decompress: %s\n", strerror(r));
+        } else {
+            const bool same = size == info.bytes &&
+                       memcmp(input, out.data, size) == 0;
             if (!same) {
                 int64_t k = -1;
-                for (size_t i = 0; i < rt_min(bytes, size) && k < 0; i++) {
+                for (size_t i = 0; i < size && k < 0; i++) {
                     if (input[i] != out.data[i]) { k = (int64_t)i; }
                 }
                 printf("compress() and decompress() differ @%d\n", (int)k);
                 // ENODATA is not original posix error; it is OpenGroup error
-                decoder.rc.error = ENODATA; // or EIO
+                r = ENODATA; // or EIO
             }
             swear(same); // to trigger breakpoint while debugging
         }
     }
+    if (r == 0 && size > 0) { // random access to the middle third
+        const size_t offset = size / 3;
+        const size_t length = size - offset * 2;
+        struct io scratch = {0};
+        io_alloc(&scratch, (size_t)1 << info.params.block_bits);
+        r = scratch.error;
+        if (r == 0) {
+            memset(out.data, 0, length);
+            const size_t n = sqz_decompress_range(decoder, in.data,
+                in.capacity, offset, length, out.data, scratch.data);
+            r = decoder->rc.error;
+            if (r == 0 && (n != length ||
+                           memcmp(input + offset, out.data, length) != 0)) {
+                printf("sqz_decompress_range() differs\n");
+                r = ENODATA;
+            }
+            swear(r == 0);
+            io_close(&scratch);
+        }
+    }
     io_close(&out);
+    io_close(&memory);
     io_close(&in);
-    return out.error;
+    return r;
 }
 
 const char* compressed = "~compressed~.bin";
 
 static errno_t test(const char* fn, const uint8_t* data, size_t bytes) {
-    errno_t r = compress(fn, compressed, data, bytes);
-    if (r == 0) {
-        r = verify(compressed, data, bytes);
+    errno_t r = 0;
+    for (int32_t b = sqz_range; b <= sqz_split && r == 0; b++) {
+        r = compress(fn, compressed, data, bytes, b);
+        if (r == 0) {
+            r = verify(compressed, data, bytes);
+        }
+        (void)remove(compressed);
     }
-    (void)remove(compressed);
     return r;
 }
 
@@ -195,7 +274,622 @@ static errno_t test_compression(const char* fn) {
     size_t bytes = 0;
     errno_t r = file_read_fully(fn, &data, &bytes);
     if (r != 0) { return r; }
-    return test(fn, data, bytes);
+    r = test(fn, data, bytes);
+    free(data);
+    return r;
+}
+
+// In memory frame round trip of data with parameters p (the filter of p
+// is applied to a copy of data first). Also decompresses a range that
+// starts and ends in the middle of blocks because filters and blocks
+// are undone one block at a time.
+
+static errno_t round_trip(const char* name, const uint8_t* data,
+                          size_t bytes, const struct sqz_params* p) {
+    struct io memory = {0}; // encoder context
+    struct io source = {0}; // filtered copy of data
+    struct io frame  = {0};
+    struct io out    = {0};
+    struct io scratch = {0};
+    io_alloc(&memory, sqz_sizeof(p));
+    io_alloc(&source, bytes + 1);
+    io_alloc(&frame, sqz_frame_bound(p, bytes));
+    io_alloc(&out, bytes + 1);
+    io_alloc(&scratch, (size_t)1 << p->block_bits);
+    errno_t r = memory.error != 0 ? memory.error :
+                source.error != 0 ? source.error :
+                frame.error  != 0 ? frame.error  :
+                out.error    != 0 ? out.error    : scratch.error;
+    size_t written = 0;
+    if (r == 0) {
+        struct sqz* s = sqz_init_with(memory.data, memory.capacity, p);
+        swear(s != null);
+        memcpy(source.data, data, bytes);
+        sqz_filter_encode(p, source.data, bytes);
+        written = sqz_frame_compress(s, p, source.data, bytes,
+                                     frame.data, frame.capacity);
+        r = s->rc.error;
+        if (r == 0) {
+            // decoder is the same context: level only shrinks
+            const size_t n = sqz_frame_decompress(s, frame.data, written,
+                                                  out.data, bytes);
+            r = s->rc.error;
+            if (r == 0 && (n != bytes || memcmp(data, out.data, bytes) != 0)) {
+                r = ENODATA;
+            }
+        }
+        const size_t block = (size_t)1 << p->block_bits;
+        if (r == 0 && bytes > block * 2) {
+            const size_t offset = block / 2 + 1;
+            const size_t length = bytes - block - 3;
+            memset(out.data, 0, length);
+            const size_t n = sqz_decompress_range(s, frame.data, written,
+                offset, length, out.data, scratch.data);
+            r = s->rc.error;
+            if (r == 0 && (n != length ||
+                           memcmp(data + offset, out.data, length) != 0)) {
+                r = ENODATA;
+            }
+        }
+    }
+    printf("%-26s backend: %d filter: %d block: 2^%-2d %8lld -> %8lld %s\n",
+           name, p->backend, p->filter, p->block_bits, (uint64_t)bytes,
+           (uint64_t)written, r == 0 ? "ok" : strerror(r));
+    swear(r == 0);
+    io_close(&scratch);
+    io_close(&out);
+    io_close(&frame);
+    io_close(&source);
+    io_close(&memory);
+    return r;
+}
+
+static errno_t test_small_blocks(void) {
+    // rANS payload of small blocks can have less room than its 16 bytes
+    // of final states, encoder must fall back instead of overflowing
+    static const char* files[] = {
+        "test/laozi.txt", "test/arm64.elf", "test/mandrill.bmp"
+    };
+    errno_t r = 0;
+    for (int i = 0; i < countof(files) && r == 0; i++) {
+        const uint8_t* data = null;
+        size_t bytes = 0;
+        if (!file_exist(files[i])) { continue; }
+        r = file_read_fully(files[i], &data, &bytes);
+        for (int32_t bb = sqz_frame_min_block_bits; bb <= 12 && r == 0; bb++) {
+            struct sqz_params p;
+            sqz_params_init(&p);
+            p.backend = sqz_rans;
+            p.window_bits = 10;
+            p.block_bits = bb;
+            r = round_trip(files[i], data, bytes, &p);
+            // tail blocks of 1..16 bytes:
+            const size_t block = (size_t)1 << bb;
+            for (size_t n = 1; n <= 16 && r == 0 && block + n <= bytes; n++) {
+                r = round_trip("tail", data, block + n, &p);
+            }
+        }
+        free((void*)data);
+    }
+    return r;
+}
+
+static errno_t test_branch_filters(void) {
+    // both branch filters over both executables (a filter of the other
+    // architecture must round trip too), in 64KB blocks so that the
+    // range decoded by round_trip() starts and ends inside of blocks
+    static const char* files[] = { "test/x64.elf", "test/arm64.elf" };
+    static const int32_t filters[] = { sqz_filter_x86, sqz_filter_arm64 };
+    errno_t r = 0;
+    for (int i = 0; i < countof(files) && r == 0; i++) {
+        const uint8_t* data = null;
+        size_t bytes = 0;
+        if (!file_exist(files[i])) { continue; }
+        r = file_read_fully(files[i], &data, &bytes);
+        for (int f = 0; f < countof(filters) && r == 0; f++) {
+            struct sqz_params p;
+            sqz_params_init(&p);
+            p.block_bits = 16;
+            p.filter = filters[f];
+            r = round_trip(files[i], data, bytes, &p);
+        }
+        free((void*)data);
+    }
+    return r;
+}
+
+static uint32_t load32(const uint8_t* p) { // little endian
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+          ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static errno_t test_element_filters(void) {
+    // Paeth over 24 bits BMP pixels, delta and shuffle over records of
+    // 7 and 12 bytes: none of the element sizes divides block size
+    // (or the 16KB shuffle tile), so partial elements at the ends of
+    // blocks are covered
+    errno_t r = 0;
+    if (file_exist("test/mandrill.bmp")) {
+        const uint8_t* data = null;
+        size_t bytes = 0;
+        r = file_read_fully("test/mandrill.bmp", &data, &bytes);
+        if (r == 0 && (bytes < 54 || data[0] != 'B' || data[1] != 'M' ||
+                       data[28] != 24)) {
+            r = EILSEQ;
+        }
+        if (r == 0) {
+            const uint32_t width = load32(data + 18);
+            struct sqz_params p;
+            sqz_params_init(&p);
+            p.block_bits = 16;
+            p.filter = sqz_filter_paeth;
+            p.stride = 3;
+            p.row = (int32_t)((width * 3 + 3) & ~3u); // 4 bytes aligned
+            r = round_trip("test/mandrill.bmp", data, bytes, &p);
+        }
+        free((void*)data);
+    }
+    static uint8_t records[300 * 1024 + 5];
+    static const int32_t strides[] = { 7, 12 };
+    static const int32_t filters[] = { sqz_filter_delta, sqz_filter_shuffle };
+    for (int i = 0; i < countof(strides) && r == 0; i++) {
+        const size_t stride = (size_t)strides[i];
+        uint32_t x = 1;
+        for (size_t k = 0; k < sizeof(records); k++) {
+            const size_t e = k / stride; // element: counter, value, flags
+            const size_t b = k % stride;
+            if (b == 0) { x = x * 1664525u + 1013904223u; }
+            records[k] = b < 4 ? (uint8_t)(e >> (b * 8)) :
+                         b < stride - 1 ? (uint8_t)((x >> 28) + (e >> 9)) :
+                                          (uint8_t)(e % 3);
+        }
+        for (int f = 0; f < countof(filters) && r == 0; f++) {
+            struct sqz_params p;
+            sqz_params_init(&p);
+            p.block_bits = 14;
+            p.filter = filters[f];
+            p.stride = strides[i];
+            r = round_trip("records", records, sizeof(records), &p);
+        }
+    }
+    return r;
+}
+
+static errno_t test_analyze(void) {
+    // filters sqz_analyze() must choose for the corpus
+    static const struct { const char* fn; int32_t filter; int32_t stride; }
+    expected[] = {
+        { "test/arm64.elf",    sqz_filter_arm64, 1 },
+        { "test/x64.elf",      sqz_filter_x86,   1 },
+        { "test/mandrill.bmp", sqz_filter_paeth, 3 },
+        { "test/laozi.txt",    sqz_filter_none,  1 },
+    };
+    errno_t r = 0;
+    for (int i = 0; i < countof(expected) && r == 0; i++) {
+        const uint8_t* data = null;
+        size_t bytes = 0;
+        if (!file_exist(expected[i].fn)) { continue; }
+        r = file_read_fully(expected[i].fn, &data, &bytes);
+        if (r == 0) {
+            struct sqz_params p;
+            sqz_params_init(&p);
+            sqz_analyze(data, bytes, &p);
+            printf("sqz_analyze(\"%s\") filter: %d stride: %d row: %d\n",
+                   expected[i].fn, p.filter, p.stride, p.row);
+            if (p.filter != expected[i].filter ||
+                p.stride != expected[i].stride ||
+                p.backend != sqz_auto || p.level != sqz_auto) {
+                r = EINVAL;
+            }
+            if (r == 0 && p.filter == sqz_filter_paeth) { // from BMP header
+                r = p.row == (int32_t)((load32(data + 18) * 3 + 3) & ~3u) ?
+                    0 : EINVAL;
+            }
+            swear(r == 0);
+        }
+        free((void*)data);
+    }
+    return r;
+}
+
+static errno_t test_reset(void) {
+    // one encoder and one decoder context are reused with sqz_reset()
+    // for different inputs of multi block frames; frames must be byte
+    // identical to the ones of freshly initialized context because
+    // the chain base and map generation carried over from previous
+    // streams must not change matches
+    static const char* files[] = {
+        "test/laozi.txt", "test/confucius.txt", "test/x64.elf",
+        "test/laozi.txt", "test/mandrill.bmp"
+    };
+    enum { limit = 256 * 1024 }; // bytes of each file
+    errno_t r = 0;
+    for (int32_t b = sqz_range; b <= sqz_split && r == 0; b++) {
+        struct sqz_params p;
+        sqz_params_init(&p);
+        p.backend = b;
+        p.block_bits = 14;
+        struct io reused = {0};
+        struct io fresh = {0};
+        struct io decoder = {0};
+        struct io frame0 = {0};
+        struct io frame1 = {0};
+        struct io out = {0};
+        io_alloc(&reused, sqz_sizeof(&p));
+        io_alloc(&fresh, sqz_sizeof(&p));
+        io_alloc(&decoder, sqz_sizeof(&p));
+        io_alloc(&frame0, sqz_frame_bound(&p, limit));
+        io_alloc(&frame1, sqz_frame_bound(&p, limit));
+        io_alloc(&out, limit);
+        r = reused.error != 0 ? reused.error : fresh.error != 0 ? fresh.error :
+            decoder.error != 0 ? decoder.error :
+            frame0.error != 0 ? frame0.error : frame1.error != 0 ?
+            frame1.error : out.error;
+        struct sqz* e = r != 0 ? null :
+            sqz_init_with(reused.data, reused.capacity, &p);
+        struct sqz* d = r != 0 ? null :
+            sqz_init_with(decoder.data, decoder.capacity, &p);
+        for (int i = 0; i < countof(files) && r == 0; i++) {
+            const uint8_t* data = null;
+            size_t bytes = 0;
+            if (!file_exist(files[i])) { continue; }
+            r = file_read_fully(files[i], &data, &bytes);
+            if (bytes > limit) { bytes = limit; }
+            size_t w0 = 0;
+            size_t w1 = 0;
+            if (r == 0) {
+                sqz_reset(e);
+                w0 = sqz_frame_compress(e, &p, data, bytes,
+                                        frame0.data, frame0.capacity);
+                r = e->rc.error;
+            }
+            if (r == 0) {
+                struct sqz* s = sqz_init_with(fresh.data, fresh.capacity, &p);
+                w1 = sqz_frame_compress(s, &p, data, bytes,
+                                        frame1.data, frame1.capacity);
+                r = s->rc.error;
+            }
+            if (r == 0 && (w0 != w1 || memcmp(frame0.data, frame1.data, w0))) {
+                printf("sqz_reset() context differs from fresh one\n");
+                r = ENODATA;
+            }
+            if (r == 0) {
+                sqz_reset(d);
+                const size_t n = sqz_frame_decompress(d, frame0.data, w0,
+                                                      out.data, bytes);
+                r = d->rc.error;
+                if (r == 0 && (n != bytes || memcmp(data, out.data, n))) {
+                    r = ENODATA;
+                }
+            }
+            printf("sqz_reset() backend: %d %-20s %7lld -> %7lld %s\n",
+                   b, files[i], (uint64_t)bytes, (uint64_t)w0,
+                   r == 0 ? "ok" : strerror(r));
+            swear(r == 0);
+            free((void*)data);
+        }
+        io_close(&out);
+        io_close(&frame1);
+        io_close(&frame0);
+        io_close(&decoder);
+        io_close(&fresh);
+        io_close(&reused);
+    }
+    return r;
+}
+
+// Pool stress: more threads than contexts acquire, round trip a slice
+// of the source through a frame and release, retrying while the pool is
+// empty. Without <threads.h> workers run one after another.
+
+enum { pool_threads = 8, pool_contexts = 4, pool_rounds = 16,
+       pool_slice = 16 * 1024 };
+
+struct pool_worker {
+    struct sqz_pool* pool;
+    const uint8_t* data; // [pool_slice * pool_rounds]
+    uint8_t  frame[pool_slice + 1024];
+    uint8_t  out[pool_slice];
+    uint32_t retries;    // acquire found no free context
+    errno_t  error;
+};
+
+static struct sqz* pool_acquire(struct pool_worker* w, int32_t kind) {
+    struct sqz* s = sqz_pool_acquire(w->pool, kind);
+    while (s == null) {
+        w->retries++;
+        #if __has_include(<threads.h>)
+            thrd_yield();
+        #endif
+        s = sqz_pool_acquire(w->pool, kind);
+    }
+    return s;
+}
+
+static int pool_work(void* arg) {
+    struct pool_worker* w = (struct pool_worker*)arg;
+    const struct sqz_params* p = &w->pool->params;
+    for (int32_t i = 0; i < pool_rounds && w->error == 0; i++) {
+        const uint8_t* d = w->data + (size_t)i * pool_slice;
+        struct sqz* e = pool_acquire(w, sqz_pool_encoder);
+        const size_t written = sqz_frame_compress(e, p, d, pool_slice,
+                                                  w->frame, sizeof(w->frame));
+        w->error = e->rc.error;
+        sqz_pool_release(w->pool, e);
+        if (w->error == 0) {
+            struct sqz* s = pool_acquire(w, sqz_pool_decoder);
+            const size_t n = sqz_frame_decompress(s, w->frame, written,
+                                                  w->out, sizeof(w->out));
+            w->error = s->rc.error;
+            if (w->error == 0 &&
+               (n != pool_slice || memcmp(d, w->out, n) != 0)) {
+                w->error = ENODATA;
+            }
+            sqz_pool_release(w->pool, s);
+        }
+    }
+    sqz_pool_flush(w->pool); // contexts cached by this thread
+    return 0;
+}
+
+static errno_t test_pool(void) {
+    const uint8_t* data = null;
+    size_t bytes = 0;
+    errno_t r = file_read_fully("test/x64.elf", &data, &bytes);
+    if (r == 0 && bytes < (size_t)pool_slice * pool_rounds) { r = E2BIG; }
+    struct sqz_params p;
+    sqz_params_init(&p);
+    p.block_bits = 13; // two blocks per slice
+    p.level = 4;
+    struct io memory = {0};
+    struct sqz_pool pool = {0};
+    if (r == 0) {
+        io_alloc(&memory, sqz_pool_sizeof(&p, pool_contexts));
+        r = memory.error;
+    }
+    if (r == 0) {
+        r = sqz_pool_init(&pool, memory.data, memory.capacity, &p,
+                          pool_contexts);
+    }
+    static struct pool_worker worker[pool_threads];
+    uint32_t retries = 0;
+    if (r == 0) {
+        for (int i = 0; i < pool_threads; i++) {
+            memset(&worker[i], 0, sizeof(worker[i]));
+            worker[i].pool = &pool;
+            // threads compress different parts of the file:
+            worker[i].data = data + (bytes - (size_t)pool_slice * pool_rounds)
+                                    / pool_threads * i;
+        }
+        #if __has_include(<threads.h>)
+            thrd_t thread[pool_threads];
+            int started = 0;
+            while (started < pool_threads && r == 0) {
+                if (thrd_create(&thread[started], pool_work,
+                                &worker[started]) != thrd_success) {
+                    r = EAGAIN;
+                } else {
+                    started++;
+                }
+            }
+            for (int i = 0; i < started; i++) { thrd_join(thread[i], null); }
+        #else
+            for (int i = 0; i < pool_threads; i++) { pool_work(&worker[i]); }
+        #endif
+        for (int i = 0; i < pool_threads; i++) {
+            if (r == 0) { r = worker[i].error; }
+            retries += worker[i].retries;
+        }
+    }
+    if (r == 0) { // every context is back: all can be acquired, no more
+        struct sqz* s[2][pool_contexts] = {0};
+        for (int32_t k = sqz_pool_encoder; k <= sqz_pool_decoder; k++) {
+            for (int i = 0; i < pool_contexts && r == 0; i++) {
+                s[k][i] = sqz_pool_acquire(&pool, k);
+                for (int j = 0; j < i && r == 0; j++) {
+                    if (s[k][i] == s[k][j]) { r = EEXIST; }
+                }
+                if (s[k][i] == null) { r = ENOMEM; }
+            }
+            if (r == 0 && sqz_pool_acquire(&pool, k) != null) { r = EEXIST; }
+        }
+        for (int32_t k = sqz_pool_encoder; k <= sqz_pool_decoder; k++) {
+            for (int i = 0; i < pool_contexts; i++) {
+                if (s[k][i] != null) { sqz_pool_release(&pool, s[k][i]); }
+            }
+        }
+        sqz_pool_flush(&pool);
+    }
+    printf("sqz_pool: %d threads %d contexts %d rounds retries: %d %s\n",
+           pool_threads, pool_contexts, pool_rounds, retries,
+           r == 0 ? "ok" : strerror(r));
+    swear(r == 0);
+    io_close(&memory);
+    free((void*)data);
+    return r;
+}
+
+static errno_t test_quiet_stats(void) {
+    // sqz_compress() without stats must not print anything and must
+    // produce the same bytes as with stats attached: statistics only
+    // observe the encoder, they do not steer it
+    const uint8_t* data = null;
+    size_t bytes = 0;
+    errno_t r = file_read_fully("test/confucius.txt", &data, &bytes);
+    struct sqz_params p;
+    sqz_params_init(&p);
+    p.block_bits = 14;
+    struct io memory = {0};
+    struct io frame[2] = {0};
+    if (r == 0) {
+        io_alloc(&memory, sqz_sizeof(&p));
+        io_alloc(&frame[0], sqz_frame_bound(&p, bytes));
+        io_alloc(&frame[1], sqz_frame_bound(&p, bytes));
+        r = memory.error != 0 ? memory.error :
+            frame[0].error != 0 ? frame[0].error : frame[1].error;
+    }
+    size_t written[2] = {0};
+    long printed = -1; // bytes written to stdout without stats
+    struct sqz_stats stats = {0};
+    for (int i = 0; i < 2 && r == 0; i++) {
+        struct sqz* s = sqz_init_with(memory.data, memory.capacity, &p);
+        swear(s != null);
+        s->stats = i == 0 ? null : &stats;
+        FILE* out = null;
+        int saved = -1;
+        if (i == 0) { // stdout is redirected into temporary file
+            fflush(stdout);
+            out = tmpfile();
+            saved = out != null ? dup(fileno(stdout)) : -1;
+            if (saved < 0 || dup2(fileno(out), fileno(stdout)) < 0) {
+                r = errno;
+            }
+        }
+        if (r == 0) {
+            written[i] = sqz_frame_compress(s, &p, data, bytes,
+                                            frame[i].data, frame[i].capacity);
+            r = s->rc.error;
+        }
+        if (saved >= 0) {
+            fflush(stdout);
+            dup2(saved, fileno(stdout));
+            close(saved);
+            fseek(out, 0, SEEK_END);
+            printed = ftell(out);
+        }
+        if (out != null) { fclose(out); }
+    }
+    if (r == 0 && printed != 0) {
+        printf("sqz_compress() printed %ld bytes without stats\n", printed);
+        r = EINVAL;
+    }
+    if (r == 0 && (written[0] != written[1] ||
+                   memcmp(frame[0].data, frame[1].data, written[0]) != 0)) {
+        printf("sqz_compress() output depends on stats\n");
+        r = ENODATA;
+    }
+    if (r == 0 && stats.literals + stats.matched != bytes) {
+        r = ENODATA; // stats attached must account for every byte
+    }
+    printf("quiet stats: %s\n", r == 0 ? "ok" : strerror(r));
+    swear(r == 0);
+    io_close(&frame[1]);
+    io_close(&frame[0]);
+    io_close(&memory);
+    free((void*)data);
+    return r;
+}
+
+static errno_t forged_range(struct sqz* s, const uint8_t* frame,
+                            size_t bytes) {
+    // frame is copied into memory of exactly `bytes` so that reads past
+    // its end are caught by address sanitizer or page heap
+    struct io copy = {0}; // bytes == 0: copy.data == null
+    if (bytes > 0) {
+        io_alloc(&copy, bytes);
+        if (copy.error != 0) { return copy.error; }
+        memcpy(copy.data, frame, bytes);
+    }
+    uint8_t out[64];
+    const size_t n = sqz_decompress_range(s, copy.data, bytes, 100,
+                                          sizeof(out), out, null);
+    const errno_t r = s->rc.error;
+    swear(n == 0 && r == EINVAL);
+    if (bytes > 0) { io_close(&copy); }
+    return r == EINVAL ? 0 : EILSEQ;
+}
+
+static void store64(uint8_t* p, uint64_t v) { // little endian
+    for (int i = 0; i < 8; i++) { p[i] = (uint8_t)(v >> (i * 8)); }
+}
+
+static errno_t test_forged_frames(void) {
+    // truncated and forged headers must be rejected with EINVAL
+    // before the block table or blocks are read
+    static uint8_t data[32 * 1024];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)("forged header "[i % 14] ^ (i >> 10));
+    }
+    struct sqz_params p;
+    sqz_params_init(&p);
+    p.block_bits = 12;
+    struct io memory = {0};
+    struct io frame = {0};
+    io_alloc(&memory, sqz_sizeof(&p));
+    io_alloc(&frame, sqz_frame_bound(&p, sizeof(data)));
+    errno_t r = memory.error != 0 ? memory.error : frame.error;
+    if (r == 0) {
+        struct sqz* s = sqz_init_with(memory.data, memory.capacity, &p);
+        swear(s != null);
+        const size_t written = sqz_frame_compress(s, &p, data, sizeof(data),
+                                                  frame.data, frame.capacity);
+        r = s->rc.error;
+        const size_t table = sqz_frame_header + 8 * sqz_frame_entry;
+        // truncated: no header, part of header, part of table, of blocks
+        const size_t truncated[] = { 0, 1, sqz_frame_header - 1,
+            sqz_frame_header, table - 1, written - 1 };
+        for (int i = 0; i < countof(truncated) && r == 0; i++) {
+            r = forged_range(s, frame.data, truncated[i]);
+        }
+        uint8_t h[sqz_frame_header];
+        if (r == 0) { // bytes = UINT64_MAX, blocks = 0
+            memcpy(h, frame.data, sizeof(h));
+            store64(h + 12, UINT64_MAX);
+            memset(h + 20, 0, 4);
+            r = forged_range(s, h, sizeof(h));
+        }
+        if (r == 0) { // more blocks than the table in the frame has
+            store64(frame.data + 12, (uint64_t)sizeof(data) * 2);
+            frame.data[20] = 16;
+            r = forged_range(s, frame.data, written);
+        }
+        if (r == 0) { // fewer source bytes than the blocks hold
+            store64(frame.data + 12, (uint64_t)sizeof(data) - 4096);
+            frame.data[20] = 8;
+            r = forged_range(s, frame.data, written);
+        }
+        printf("forged frames: %s\n", r == 0 ? "ok" : strerror(r));
+    }
+    io_close(&frame);
+    io_close(&memory);
+    return r;
+}
+
+static errno_t test_tight_frame(void) {
+    // incompressible block that cannot be stored in the remaining
+    // capacity must fail with E2BIG instead of a 0 bytes table entry
+    static uint8_t data[64 * 1024];
+    uint32_t x = 0x2545F491;
+    for (size_t i = 0; i < sizeof(data); i++) { // xorshift32
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        data[i] = (uint8_t)(x >> 24);
+    }
+    struct sqz_params p;
+    sqz_params_init(&p);
+    p.block_bits = 16;
+    struct io memory = {0};
+    struct io frame = {0};
+    io_alloc(&memory, sqz_sizeof(&p));
+    io_alloc(&frame, sqz_frame_bound(&p, sizeof(data)));
+    errno_t r = memory.error != 0 ? memory.error : frame.error;
+    if (r == 0) {
+        struct sqz* s = sqz_init_with(memory.data, memory.capacity, &p);
+        swear(s != null);
+        const size_t capacity = sqz_frame_header + sqz_frame_entry + 100;
+        const size_t written = sqz_frame_compress(s, &p, data, sizeof(data),
+                                                  frame.data, capacity);
+        r = written == 0 && s->rc.error == E2BIG ? 0 : EINVAL;
+        if (r == 0) { // and with enough room it is stored
+            const size_t n = sqz_frame_compress(s, &p, data, sizeof(data),
+                                                frame.data, frame.capacity);
+            r = s->rc.error;
+            if (r == 0 && n != capacity - 100 + sizeof(data)) { r = EINVAL; }
+        }
+        printf("tight frame: %s\n", r == 0 ? "ok" : strerror(r));
+    }
+    io_close(&frame);
+    io_close(&memory);
+    return r;
 }
 
 static errno_t locate_test_folder(void) {
@@ -204,10 +898,11 @@ static errno_t locate_test_folder(void) {
     // MSVC it is buried inside bin/... folder depths
     // on X Code in MacOS it can be completely out of tree.
     // So we need to find the test files.
-    for (;;) {
-        if (file_exist("test/bible.txt")) { return 0; }
+    for (int32_t up = 0; up < 8; up++) {
+        if (file_exist("test/laozi.txt")) { return 0; }
         if (file_chdir("..") != 0) { return errno; }
     }
+    return ENOENT;
 }
 
 static void experiment(void);
@@ -248,8 +943,8 @@ int main(int argc, const char* argv[]) {
         "test/confucius.txt",
         "test/laozi.txt",
         "test/sqlite3.c",
-//      "test/arm64.elf",
-//      "test/x64.elf",
+        "test/arm64.elf",
+        "test/x64.elf",
 //      "test/mandrill.bmp",
 //      "test/mandrill.png",
     };
@@ -258,11 +953,20 @@ int main(int argc, const char* argv[]) {
             r = test_compression(files[i]);
         }
     }
+    if (r == 0) { r = test_small_blocks(); }
+    if (r == 0) { r = test_forged_frames(); }
+    if (r == 0) { r = test_tight_frame(); }
+    if (r == 0) { r = test_branch_filters(); }
+    if (r == 0) { r = test_element_filters(); }
+    if (r == 0) { r = test_analyze(); }
+    if (r == 0) { r = test_reset(); }
+    if (r == 0 && file_exist("test/x64.elf")) { r = test_pool(); }
+    if (r == 0) { r = test_quiet_stats(); }
     return r;
 }
 
 ///
-#if 1
+#if 0 // binary tree match finder experiment, see bst.c
 
 enum { window = 8, min_size = 2, max_size = 254 };
 